@@ -38,6 +38,7 @@ RepRap M Codes
  M107 - Fan 1 off
  M109 - Wait for extruder current temp to reach target temp.
  M114 - Display current position
+ M116 - Wait for all heaters to reach their targets, S<hotend temp> T<extruder> B<bed temp> set targets first
 
 Custom M Codes
  M20  - List SD card
@@ -67,7 +68,7 @@ Custom M Codes
  M140 - Set bed target temp
  M176 - Fan 2 on
  M177 - Fan 2 off
- M190 - Wait for bed current temp to reach target temp.
+ M190 - Wait for bed current temp to reach target temp. (with CONCURRENT_HEATUP the wait is done by the next M109/M116 or move)
  M201 - Set maximum acceleration in units/s^2 for print moves (M201 X1000 Y1000)
  M202 - Set maximum feedrate that your machine can sustain (M203 X200 Y200 Z300 E10000) in mm/sec
  M203 - Set temperture monitor to Sx
@@ -79,12 +80,16 @@ Custom M Codes
  M220 - set speed factor override percentage S=factor in percent 
  M221 - set extruder multiply factor S100 --> original Extrude Speed 
 
-Note: M301, M303, M304 applies to currently selected extruder.	Use T0 or T1 to select.
- M301 - Set Heater parameters P, I, D, S (slope), B (y-intercept), W (maximum pwm)
+Note: M301, M303, M306 applies to currently selected extruder.	Use T0 or T1 to select.
+ M301 - Set Heater parameters P, I, D, S (slope), B (y-intercept), W (maximum pwm), F (extrusion feed-forward)
  M303 - PID relay autotune S<temperature> sets the target temperature. (default target temperature = 150C)
- M304 - Calculate slope and y-intercept for HEATER_DUTY_FOR_SETPOINT formula.
-		 Caution - this can take 30 minutes to complete and will heat the hotend 
-				   to 200 degrees.
+		 B1 tunes the heatbed instead of the extruder. Runs in the background and reports
+		 the progress, C1 cancels it.
+ M304 - Set Heatbed PID parameters P, I, D
+ M306 - Calculate slope and y-intercept for HEATER_DUTY_FOR_SETPOINT formula and store them.
+		 The hotend is held at N (default 4) setpoints from L (default HEATER_CAL_LOW) to
+		 S (default 200), the steady-state pwm is measured at each. Runs in the background,
+		 C1 cancels it. Caution - this can take 30 minutes to complete.
 
  M400 - Finish all moves
 
@@ -97,13 +102,21 @@ Note: M301, M303, M304 applies to currently selected extruder.	Use T0 or T1 to s
  M525 - Set homing direction 1=+, -1=- (M525 X-1 Y-1 Z-1)
  M526 - Invert endstop inputs 0=false, 1=true (M526 X0 Y0 Z0)
  
+ M560 - Raw binary upload to SD file (M560 S<bytes> filename.g), see sdcard_uploadfeed(). Wait for the reply
+		 before sending the frames: uint16 length (1-512), payload, crc16 of the payload (little endian).
+ M630 - Accept binary move frames 1=true, 0=false (M630 S1), see gcode_binary_frame()
+ M631 - Show command statistics, S1 resets them
+ M632 - Show main loop task runtimes, S1 resets them
+ M633 - Dump the heater log (time, heater, temperature in 1/16 C, target, pwm, P/I/D/feed-forward terms) as CSV, S1 clears it
+ 
 Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select.
  M530 - Set heater sensor (thermocouple) type B (bed) E (extruder) (M530 E11 B11)
  M531 - Set heater PWM mode 0=false, 1=true (M531 E1)
  
- M350 - Set microstepping steps (M350 X16 Y16 Z16 E16 B16)
+ M350 - Set microstepping steps (M350 X16 Y16 Z16 E16 B16), R sets the speed in 1/16 steps per second above which X, Y and Z use 1/4 steps (0 = never)
  M906 - Set motor current (mA) (M906 X1000 Y1000 Z1000 E1000 B1000) or set all (M906 S1000)
  M907 - Set motor current (raw) (M907 X128 Y128 Z128 E128 B128) or set all (M907 S128)
+ M909 - Set dynamic motor current: I idle current and A acceleration current in percent of M906/M907, S seconds until idle (0 = never)
 
  M500 - stores paramters in EEPROM
  M501 - reads parameters from EEPROM (if you need to reset them after you changed them temporarily).
@@ -133,8 +146,21 @@ Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select
 #include "motoropts.h"
 #include "sdcard.h"
 #include "globals.h"
+#include "util.h"
+#include "scheduler.h"
 
 #define BUFFER_SIZE 256
+//size of the receive ring, must be a power of two
+#define RX_BUFFER_SIZE 1024
+
+//binary move frames (M630 S1):
+// 0xA5, type, sequence number, payload, crc16 of type..payload (little endian)
+//all values are little endian, coordinates in micrometers, feedrate in mm/min (0 = keep)
+#define BIN_SYNC 0xA5
+#define BIN_MOVE_DELTA 0x01		//int16 X, Y, Z, E relative to the last position, uint16 F
+#define BIN_MOVE_ABS 0x02		//int32 X, Y, Z, E absolute, uint16 F
+#define BIN_HEADER_LEN 3
+#define BIN_FRAME_MAX (BIN_HEADER_LEN + 4*4 + 2 + 2)
 
 #define DEBUG_PARSER
 
@@ -145,12 +171,14 @@ Note: M530, M531 applies to currently selected extruder.  Use T0 or T1 to select
 #define DEBUG(...)
 #endif
 
+//single producer (usb interrupt) / single consumer (main loop) ring buffer.
+//readPos is only written by the consumer and writePos only by the producer, both run freely
+//and are masked on access, so no shared counter needs to be updated from both sides.
 typedef struct 
 {
-	int readPos;
-	int writePos;
-	int numBytes;
-	uint8_t buffer[BUFFER_SIZE];
+	volatile uint32_t readPos;
+	volatile uint32_t writePos;
+	uint8_t buffer[RX_BUFFER_SIZE];
 } RingBuffer;
 
 
@@ -159,71 +187,180 @@ void ringbuffer_init(RingBuffer* pBuffer)
 	memset(pBuffer,0,sizeof(RingBuffer));
 }
 
-int ringbuffer_numFree(const RingBuffer* pBuffer)
+uint32_t ringbuffer_numFree(const RingBuffer* pBuffer)
+{
+	return RX_BUFFER_SIZE - (pBuffer->writePos - pBuffer->readPos);
+}
+
+uint32_t ringbuffer_numAvailable(const RingBuffer* pBuffer)
 {
-	return BUFFER_SIZE-pBuffer->numBytes;
+	return pBuffer->writePos - pBuffer->readPos;
 }
 
-int ringbuffer_numAvailable(const RingBuffer* pBuffer)
+//producer side: copy as much of data as fits, returns the number of bytes stored
+uint32_t ringbuffer_write(RingBuffer* pBuffer,const uint8_t* data,uint32_t len)
 {
-	return pBuffer->numBytes;
+	uint32_t writePos = pBuffer->writePos;
+	uint32_t numFree = ringbuffer_numFree(pBuffer);
+	uint32_t offset = writePos & (RX_BUFFER_SIZE-1);
+	uint32_t first;
+	
+	if (len > numFree)
+		len = numFree;
+	
+	first = RX_BUFFER_SIZE - offset;
+	if (first > len)
+		first = len;
+	
+	memcpy(&pBuffer->buffer[offset],data,first);
+	memcpy(&pBuffer->buffer[0],data+first,len-first);
+	
+	//data has to be in place before the consumer can see the new write position
+	memory_barrier();
+	pBuffer->writePos = writePos + len;
+	return len;
 }
 
-uint8_t ringbuffer_get(RingBuffer* pBuffer)
+//consumer side: returns the number of contiguous bytes available at *ppData
+uint32_t ringbuffer_peek(const RingBuffer* pBuffer,const uint8_t** ppData)
 {
-	uint8_t b = pBuffer->buffer[pBuffer->readPos++];
-	pBuffer->readPos &= (BUFFER_SIZE-1);
-	pBuffer->numBytes--;
-	return b;
+	uint32_t readPos = pBuffer->readPos;
+	uint32_t offset = readPos & (RX_BUFFER_SIZE-1);
+	uint32_t avail = pBuffer->writePos - readPos;
+	
+	memory_barrier();
+	*ppData = &pBuffer->buffer[offset];
+	return (avail < RX_BUFFER_SIZE - offset) ? avail : RX_BUFFER_SIZE - offset;
 }
 
-void ringbuffer_put(RingBuffer* pBuffer,uint8_t b)
+//consumer side: release bytes returned by ringbuffer_peek
+void ringbuffer_skip(RingBuffer* pBuffer,uint32_t len)
 {
-	pBuffer->buffer[pBuffer->writePos++] = b;
-	pBuffer->writePos &= (BUFFER_SIZE-1);
-	pBuffer->numBytes++;
+	memory_barrier();
+	pBuffer->readPos += len;
 }
 
 
 //----------------------------------------------------------------------------------------------
 static RingBuffer uartBuffer;
 
-static void gcode_datareceived(unsigned char chr)
+static unsigned int gcode_datareceived(const unsigned char* data,unsigned int len)
 {
-	if (ringbuffer_numFree(&uartBuffer))
-		ringbuffer_put(&uartBuffer,chr);
+	return ringbuffer_write(&uartBuffer,data,len);
 }
 
 
+//state of a command waiting for a condition, see gcode_start_wait()
+typedef struct
+{
+	int (*poll)();
+	heater_struct* heater;
+	int min_target;
+	int max_target;
+	long residencyStart;
+	uint32_t lastReport;
+	uint32_t until;
+	uint8_t deferred;		//no "ok" is due when the wait is done, see gcode_check_heatup()
+} WaitState;
+
+//bed and hotend heat-up, see CONCURRENT_HEATUP and HEATUP_FINISH_TOGETHER
+typedef struct
+{
+	uint8_t bedPending;			//M190 returned before the bed reached its target
+	heater_struct* heldHeater;	//hotend whose target is held back until the bed is nearly done
+	int heldTarget;
+	int lastBedTemp;
+	int lastHotendTemp;
+	uint32_t lastSample;
+	float bedRate;				//measured heating rates in C/s
+	float hotendRate;
+} HeatupState;
+
+//lines received while a command is waiting are checked and kept here until it is done
+#define LINE_QUEUE_SIZE 4
+
+typedef struct
+{
+	uint8_t binary;		//data holds a binary move frame instead of a line
+	char data[BUFFER_SIZE];
+} QueuedLine;
+
 typedef struct 
 {
 	int comment_mode : 1;
+	int binary_mode : 1;
+	int cr_pending : 1;		//the last line ended with '\r', a '\n' may follow
+	int bin_drop : 1;		//resync after a bad binary frame, see gcode_feed()
 	int commandLen;
 	uint32_t last_N;
 	uint32_t line_N;
 	char commandBuffer[BUFFER_SIZE];
 	char* parsePos;
+	const char* params[26];		//first occurrence of each parameter letter
+	uint32_t paramsValid;		//letters looked up by gcode_tokenize()
+	uint32_t paramsFound;		//letters present in the line
 	ReplyFunction replyFunc;
+	ReplyFunction reportFunc;
+	WaitState wait;
+	HeatupState heatup;
+	QueuedLine lineQueue[LINE_QUEUE_SIZE];
+	uint8_t queueHead;
+	uint8_t queueCount;
+	uint8_t binFrame[BIN_FRAME_MAX];
+	uint8_t binLen;
+	uint8_t binSeq;
+	int32_t binPosition[NUM_AXIS];
+	float binLastPosition[NUM_AXIS];
 } ParserState;
 
 
 static ParserState parserState;
 
+//record the parameter letters of the command in one pass over the line,
+//params is the set of letters the command handler uses
+static void gcode_tokenize(uint32_t params)
+{
+	const char* ptr;
+	uint32_t found = 0;
+	
+	for (ptr = parserState.parsePos; *ptr; ptr++)
+	{
+		uint32_t idx = (uint8_t)*ptr - 'A';
+		if (idx < 26 && (params & ~found & (1UL << idx)))
+		{
+			parserState.params[idx] = ptr;
+			found |= 1UL << idx;
+		}
+	}
+	parserState.paramsFound = found;
+	parserState.paramsValid = params;
+}
+
+//position of a code in the current line, letters not recorded by gcode_tokenize() are searched
+static const char* find_code(char chr)
+{
+	uint32_t idx = (uint8_t)chr - 'A';
+	if (idx < 26 && (parserState.paramsValid & (1UL << idx)))
+		return (parserState.paramsFound & (1UL << idx)) ? parserState.params[idx] : NULL;
+	
+	return strchr(parserState.parsePos,chr);
+}
+
 int32_t get_int(char chr)
 {
-	char* ptr = strchr(parserState.parsePos,chr);
+	const char* ptr = find_code(chr);
 	return ptr ? strtol(ptr+1,NULL,10) : 0;
 }
 
 uint32_t get_uint(char chr)
 {
-	char* ptr = strchr(parserState.parsePos,chr);
+	const char* ptr = find_code(chr);
 	return ptr ? strtoul(ptr+1,NULL,10) : 0;
 }
 
 float get_float(char chr)
 {
-	char* ptr = strchr(parserState.parsePos,chr);
+	const char* ptr = find_code(chr);
 	return ptr ? strtod(ptr+1,NULL) : 0;
 }
 
@@ -234,13 +371,13 @@ uint32_t get_bool(char chr)
 
 const char* get_str(char chr)
 {
-	char *ptr = strchr(parserState.parsePos,chr);
+	const char *ptr = find_code(chr);
 	return ptr ? ptr+1 : NULL;
 }
 
 int has_code(char chr)
 {
-	return strchr(parserState.parsePos,chr) != NULL;
+	return find_code(chr) != NULL;
 }
 
 static uint8_t get_command()
@@ -284,806 +421,1542 @@ static uint8_t calculate_checksum(const char* pLine)
 }
 
 #define sendReply(...) { if (parserState.replyFunc) { parserState.replyFunc(__VA_ARGS__); } }
+#define sendReport(...) { if (parserState.reportFunc) { parserState.reportFunc(__VA_ARGS__); } }
 
 enum ProcessReply {
 	NO_REPLY,
 	SEND_REPLY,
+	WAIT_REPLY,		//command continues in parserState.wait, "ok" is sent when it is done
 };
 
+//start a command that waits for a condition (heater temperature, moves finished) without
+//blocking the main loop. the poll function is called from gcode_update() until it returns true.
+static int gcode_start_wait(int (*poll)())
+{
+	if (poll())
+		return SEND_REPLY;
+	
+	parserState.wait.deferred = false;
+	parserState.wait.poll = poll;
+	return WAIT_REPLY;
+}
+
 
 #define GET_AXES(var,type,count) { int cnt_c; for(cnt_c = 0;cnt_c < count;cnt_c++) { if (has_code(axis_codes[cnt_c])) var[cnt_c] = get_##type(axis_codes[cnt_c]); } }
 #define GET_ALL_AXES(var,type) GET_AXES(var,type,NUM_AXIS)
 #define GET(code,default_value) has_code(code) ? get_int(code) : default_value
 
 
-//process the actual gcode command
-static int gcode_process_command()
-{
-	switch(get_command())
-	{
-		case 'G':
-		{
-			if (sdcard_iscapturing()) {
-				sdcard_writeline(parserState.parsePos);
-				break;
-			}
-			switch(get_int('G'))
-			{
-				case 0:
-				case 1:
-					get_coordinates();
-					prepare_move();
-					break;
-				case 2:
-					get_arc_coordinates();
-					prepare_arc_move(1);
-					break;
-				case 3:
-					get_arc_coordinates();
-					prepare_arc_move(0);
-					break;
-				case 4:
-				{
-					uint32_t wait_until = 0;
-					if(has_code('P')) 
-						wait_until = get_uint('P'); // milliseconds to wait
-					if(has_code('S')) 
-						wait_until = get_uint('S') * 1000; // seconds to wait
-					
-					wait_until += timestamp;  // keep track of when we started waiting
-					st_synchronize();  // wait for all movements to finish
-
-					while(timestamp	 < wait_until )
-					{
-					}
-					break;
-				}
-				case 21:
-					break;
-				case 28: //G28 Home all Axis one at a time
-					saved_feedrate = feedrate;
-					saved_feedmultiply = feedmultiply;
-					previous_millis_cmd = timestamp;
-
-					feedmultiply = 100;	   
-
-					enable_endstops(1);
-
-					feedrate = 0;
-					is_homing = 1;
-
-					home_all_axis = !((has_code(axis_codes[0])) || (has_code(axis_codes[1])) || (has_code(axis_codes[2])));
-
-					if((home_all_axis) || (has_code(axis_codes[X_AXIS])))
-						homing_routine(X_AXIS);
-
-					if((home_all_axis) || (has_code(axis_codes[Y_AXIS])))
-						homing_routine(Y_AXIS);
-
-					if((home_all_axis) || (has_code(axis_codes[Z_AXIS])))
-						homing_routine(Z_AXIS);
-
-				#ifdef ENDSTOPS_ONLY_FOR_HOMING
-					enable_endstops(0);
-				#endif
-
-					is_homing = 0;
-					feedrate = saved_feedrate;
-					feedmultiply = saved_feedmultiply;
+//----------------------------------------------------------------------------------------------
+// command handlers, return SEND_REPLY to acknowledge the command with "ok"
 
-					previous_millis_cmd = timestamp;
-					break;
-				case 90: // G90
-					relative_mode = 0;
-					break;
-				case 91: // G91
-					relative_mode = 1;
-					break;
-				case 92: // G92
-				{
-					if(!has_code(axis_codes[E_AXIS])) 
-						st_synchronize();
+//G1 - Coordinated Movement X Y Z E
+static int gcode_g1()
+{
+	get_coordinates();
+	prepare_move();
+	return SEND_REPLY;
+}
 
-					GET_ALL_AXES(current_position,float);
-					plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+//G2 - CW ARC
+static int gcode_g2()
+{
+	get_arc_coordinates();
+	prepare_arc_move(1);
+	return SEND_REPLY;
+}
 
-					break;
-				}
-				default:
-					sendReply("Unknown G%d\n\r",get_int('G'));
-					return NO_REPLY;
-			}
-			break;
-		}
-		case 'M':
-		{
-			int mcode = get_int('M');
-			if (sdcard_iscapturing() && (mcode < 20 || mcode > 29)) {
-				sdcard_writeline(parserState.parsePos);
-				break;
-			}
-			switch(mcode)
-			{
-				case 20: //list sd files
-					sdcard_listfiles();
-//					break;
-					return NO_REPLY;
-				case 21: //init sd card
-					sdcard_mount();
-					break;
-				case 22: //release sd card
-					sdcard_unmount();
-					break;
-				case 23: //select sd file
-					sdcard_selectfile(get_str(' '));
-					break;
-				case 24: //start/resume sd print
-					sdcard_replaystart();
-					break;
-				case 25: //pause sd print
-					sdcard_replaypause();
-					break;
-				case 26: //set sd position
-					if (has_code('S'))
-						sdcard_setposition(get_uint('S'));
-					break;
-				case 27: //sd print status
-					sdcard_printstatus();
-					return NO_REPLY;
-				case 28: //begin write to sd file
-					//sdcard_selectfile();
-					sdcard_capturestart(get_str(' '));
-					break;
-				case 29: //stop writing sd file
-					sdcard_capturestop();
-					break;
-				
-				case 44:
-					if (strcmp(get_str(' '),"IKnowWhatIAmDoing") == 0)
-					{
-						FLASH_BootFromROM();
-						sendReply("bootloader enabled\n\r")
-					}
-					else
-					{
-						FLASH_BootFromFLASH();
-					}
-					break;
-				case 82:
-					axis_relative_modes[3] = 0;
-					break;
-				case 83:
-					axis_relative_modes[3] = 1;
-					break;
-				case 84:
-					st_synchronize(); // wait for all movements to finish
-					if(has_code('S'))
-					{
-					  stepper_inactive_time = get_uint('S') * 1000; 
-					}
-					else if(has_code('T'))
-					{
-					  enable_x(); 
-					  enable_y(); 
-					  enable_z(); 
-					  enable_e(); 
-					}
-					else
-					{ 
-					  disable_x(); 
-					  disable_y(); 
-					  disable_z(); 
-					  disable_e(); 
-					}
-					break;
-				case 85: // M85
-					if (has_code('S'))
-						max_inactive_time = get_uint('S') * 1000; 
-					break;
-				case 92: // M92
-				{
-					int cnt_c;
-					for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
-					{
-						if(has_code(axis_codes[cnt_c])) 
-						{
-							pa.axis_steps_per_unit[cnt_c] = get_float(axis_codes[cnt_c]);
-							axis_steps_per_sqr_second[cnt_c] = pa.max_acceleration_units_per_sq_second[cnt_c] * pa.axis_steps_per_unit[cnt_c];
-						}
-					}
-					break;
-				}
-				case 93: // M93 show current axis steps.
-					sendReply("X:%d Y:%d Z:%d E:%d",(int)pa.axis_steps_per_unit[0],(int)pa.axis_steps_per_unit[1],(int)pa.axis_steps_per_unit[2],(int)pa.axis_steps_per_unit[3]);
-					break;
-			  
-				case 104: // M104
-					if (has_code('S'))
-					{
-						heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
-						if (heater)
-							heater->target_temp = get_uint('S');
-					}
-					break;
-				case 105: // M105
-				{
-					heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
-                    
-					if (heater)
-					{
-                        const char* ok = (sdcard_isreplaying()) ? "" : "ok ";
-                        sendReply("%sT:%u @%u B:%u \r\n",ok,heater->akt_temp,heater->pwm,bed_heater.akt_temp);
-					}
-					return NO_REPLY;
-				}
-				case 106: //M106 Fan 1 On
-					  if (has_code('S'))
-					  {
-						g_pwm_value[2] = constrain(get_uint('S'),0,255);		  
-					  }
-					  else 
-					  {
-						g_pwm_value[2] = 255;
-					  }
-					  g_pwm_aktiv[2] = 1;
-					  break;
-				case 107: //M107 Fan 1 Off
-					  g_pwm_value[2] = 0;
-					  break;
-				case 109: // M109 - Wait for extruder heater to reach target.
-				{
-					heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
-				
-					if (heater)
-					{
-	
-						int min_target,max_target;
-
-						if (has_code('S'))
-						{
-							heater->target_temp = get_uint('S');
-							min_target = heater->target_temp;
-						}
-						else
-						{
-							min_target = heater->target_temp - TEMP_HYSTERESIS;
-						}
-						
-						max_target = has_code('R') ? get_uint('R') : heater->target_temp + TEMP_HYSTERESIS;
-					
-						uint32_t codenum = timestamp; 
-
-						//loops separated for cleanliness
-					#ifdef TEMP_RESIDENCY_TIME
-						long residencyStart;
-						residencyStart = -1;
-
-						while(1)
-						{
-							if (heater->akt_temp < min_target || heater->akt_temp > max_target)
-							{
-								residencyStart = -1;
-								if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up/cooling down
-								{
-									sendReply("T:%u \r\n",heater->akt_temp);
-									codenum = timestamp;
-								}
-							}
-							else
-							{
-								if ((residencyStart > (-1)) && ((timestamp - residencyStart) > TEMP_RESIDENCY_TIME*1000))
-								{
-									break; //done
-								}
-								else
-								{
-									residencyStart = timestamp;
-								}
-							}
-						}
-					#else
-						while(1)
-						{
-							if (heater->akt_temp < min_target || heater->akt_temp > max_target)
-							{
-								if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up/cooling down
-								{
-									sendReply("T:%u \r\n",heater->akt_temp);
-									codenum = timestamp;
-								}
-							}
-							else
-							{
-								break; //done
-							}
-						}
-					}
-					#endif
-					break;
-				}
-				case 110:
-					break;
-				case 114: // M114 Display current position
-					sendReply("X:%f Y:%f Z:%f E:%f ",current_position[0],current_position[1],current_position[2],current_position[3]);
-					break;			  
-				case 115: // M115
-                {
-                    const char* ok = (sdcard_isreplaying()) ? "" : "ok ";
-					sendReply("%sFIRMWARE_NAME: Sprinter 4pi PROTOCOL_VERSION:1.0 MACHINE_TYPE:Prusa EXTRUDER_COUNT:%d\r\n", ok, MAX_EXTRUDER);
-					return NO_REPLY;
-                }
-				case 119: // M119 show endstop state
-				{
-					char read_endstops[6] = {'X','X','X','X','X','X'};
-				  
-					if(pa.x_min_endstop_aktiv > -1)
-						read_endstops[0] = (PIO_Get(&X_MIN_PIN) ^ pa.x_endstop_invert) + 48;
+//G3 - CCW ARC
+static int gcode_g3()
+{
+	get_arc_coordinates();
+	prepare_arc_move(0);
+	return SEND_REPLY;
+}
 
-					if(pa.y_min_endstop_aktiv > -1)
-						read_endstops[1] = (PIO_Get(&Y_MIN_PIN) ^ pa.y_endstop_invert) + 48;
+//G4 - Dwell S<seconds> or P<milliseconds>
+static int gcode_wait_dwell()
+{
+	return !blocks_queued() && timestamp >= parserState.wait.until;
+}
 
-					if(pa.z_min_endstop_aktiv > -1)
-						read_endstops[2] = (PIO_Get(&Z_MIN_PIN) ^ pa.z_endstop_invert) + 48;
+static int gcode_g4()
+{
+	uint32_t wait_until = 0;
+	if(has_code('P')) 
+		wait_until = get_uint('P'); // milliseconds to wait
+	if(has_code('S')) 
+		wait_until = get_uint('S') * 1000; // seconds to wait
+	
+	parserState.wait.until = wait_until + timestamp;  // keep track of when we started waiting
+	return gcode_start_wait(gcode_wait_dwell);  // also waits for all movements to finish
+}
 
-					if(pa.x_max_endstop_aktiv > -1)
-						read_endstops[3] = (PIO_Get(&X_MAX_PIN) ^ pa.x_endstop_invert) + 48;
+//G21 - Set units to millimeters
+static int gcode_g21()
+{
+	return SEND_REPLY;
+}
 
-					if(pa.y_max_endstop_aktiv > -1)
-						read_endstops[4] = (PIO_Get(&Y_MAX_PIN) ^ pa.y_endstop_invert) + 48;
+//G28 - Home all Axis one at a time
+static int gcode_g28()
+{
+	saved_feedrate = feedrate;
+	saved_feedmultiply = feedmultiply;
+	previous_millis_cmd = timestamp;
 
-					if(pa.z_max_endstop_aktiv > -1)
-						read_endstops[5] = (PIO_Get(&Z_MAX_PIN) ^ pa.z_endstop_invert) + 48; 
+	feedmultiply = 100;	   
 
+	enable_endstops(1);
 
-					sendReply("Xmin:%c Ymin:%c Zmin:%c / Xmax:%c Ymax:%c Zmax:%c ",read_endstops[0],read_endstops[1],read_endstops[2],read_endstops[3],read_endstops[4],read_endstops[5]);
-					break;
-				}
-				case 140: // M140 set bed temp
-					if (has_code('S')) 
-						bed_heater.target_temp = get_uint('S');
+	feedrate = 0;
+	is_homing = 1;
 
-					break;
-				case 176: //M176 Fan 2 On
-					  if (has_code('S'))
-					  {
-						g_pwm_value[3] = constrain(get_uint('S'),0,255);		  
-					  }
-					  else 
-					  {
-						g_pwm_value[3] = 255;
-					  }
-					  g_pwm_aktiv[3] = 1;
-					  break;
-				case 177: //M177 Fan 2 Off
-					  g_pwm_value[3] = 0;
-					  break;
-				case 190: // M190 - Wait for bed heater to reach target temperature.
-				{
-					if (has_code('S'))
-						bed_heater.target_temp = get_float('S');
-
-					uint32_t codenum = timestamp;
-					while(bed_heater.akt_temp < bed_heater.target_temp) 
-					{
-						if( (timestamp - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up.
-						{
-							heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
-
-							if (heater)
-							{
-								sendReply("T:%u B:%u\r\n",heater->akt_temp,bed_heater.akt_temp);
-							}
-							codenum = timestamp; 
-						}
-					}
-					break;
-				}
-				case 201: // M201	 Set maximum acceleration in units/s^2 for print moves (M201 X1000 Y1000)
-				{
-					int cnt_c;
-					for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
-					{
-						if(has_code(axis_codes[cnt_c]))
-						{
-							float acc = get_float(axis_codes[cnt_c]);
-							pa.max_acceleration_units_per_sq_second[cnt_c] = acc;
-							axis_steps_per_sqr_second[cnt_c] = acc * pa.axis_steps_per_unit[cnt_c];
-						}
-					}
-					break;
-				}
-				case 202: // M202 max feedrate mm/sec
-				{
-					GET_ALL_AXES(pa.max_feedrate,float);
-					break;
-				}
-				case 203: // M203 Temperature monitor
-					//if(code_seen('S')) manage_monitor = code_value();
-					//if(manage_monitor==100) manage_monitor=1; // Set 100 to heated bed
-					break;
-				case 204: // M204 acceleration S normal moves T filmanent only moves
-					if(has_code('S')) 
-						pa.move_acceleration = get_float('S');
+	home_all_axis = !((has_code(axis_codes[0])) || (has_code(axis_codes[1])) || (has_code(axis_codes[2])));
 
-					if(has_code('T'))
-						pa.retract_acceleration = get_float('T');
-					break;
-				case 205: //M205 advanced settings:	 minimum travel speed S=while printing T=travel only,	 B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E= max E jerk
-					if(has_code('S')) 
-						pa.minimumfeedrate = get_float('S');
+	if((home_all_axis) || (has_code(axis_codes[X_AXIS])))
+		homing_routine(X_AXIS);
 
-					if(has_code('T')) 
-						pa.mintravelfeedrate = get_float('T');
-					//if(code_seen('B')) minsegmenttime = code_value() ;
+	if((home_all_axis) || (has_code(axis_codes[Y_AXIS])))
+		homing_routine(Y_AXIS);
 
-					if(has_code('X')) 
-						pa.max_xy_jerk = get_float('X');
+	if((home_all_axis) || (has_code(axis_codes[Z_AXIS])))
+		homing_routine(Z_AXIS);
 
-					if(has_code('Z'))
-						pa.max_z_jerk = get_float('Z');
+#ifdef ENDSTOPS_ONLY_FOR_HOMING
+	enable_endstops(0);
+#endif
 
-					if(has_code('E'))
-						pa.max_e_jerk = get_float('E');
-					break;
-				case 206: // M206 additional homing offset
-				{
-					GET_AXES(pa.add_homing,float,3);
-					break;
-				}	
-				case 207: //M207 Homing Feedrate mm/min Xnnn Ynnn Znnn
-				{
-					GET_AXES(pa.homing_feedrate,float,3);
-					break;
-				}
-				case 220: // M220 S<factor in percent>- set speed factor override percentage
-				{
-					if(has_code('S')) 
-					{
-						feedmultiply = constrain(get_uint('S'), 20, 200);
-						feedmultiplychanged=1;
-					}
-				  break;
-				}
-				case 221: // M221 S<factor in percent>- set extrude factor override percentage
-				{
-					if(has_code('S')) 
-					{
-						extrudemultiply = constrain(get_uint('S'), 40, 200);
-					}
-					break;
-				}
-				case 301: // M301
-				{
-					int extruder = GET('T',active_extruder);
-					heater_struct* heater = get_heater(extruder);
-		
-					if (heater)
-					{
-						if(has_code('P'))
-							heater->PID_Kp = pa.heater_pTerm[extruder] = get_uint('P');
+	is_homing = 0;
+	feedrate = saved_feedrate;
+	feedmultiply = saved_feedmultiply;
 
-						if(has_code('I'))
-							heater->PID_I	 = pa.heater_iTerm[extruder] = get_uint('I');
+	previous_millis_cmd = timestamp;
+	return SEND_REPLY;
+}
 
-						if(has_code('D'))
-							heater->PID_Kd = pa.heater_dTerm[extruder] = get_uint('D');
+//G90 - Use Absolute Coordinates
+static int gcode_g90()
+{
+	relative_mode = 0;
+	return SEND_REPLY;
+}
 
-						if(has_code('S'))
-							heater->slope = pa.heater_slope[extruder] = get_uint('S');
+//G91 - Use Relative Coordinates
+static int gcode_g91()
+{
+	relative_mode = 1;
+	return SEND_REPLY;
+}
 
-						if(has_code('B'))
-							heater->intercept = pa.heater_intercept[extruder] = get_uint('B');
+//G92 - Set current position to cordinates given
+static int gcode_g92()
+{
+	if(!has_code(axis_codes[E_AXIS])) 
+		st_synchronize();
 
-						if(has_code('W'))
-							heater->max_pwm = pa.heater_max_pwm[extruder] = get_uint('W');
+	GET_ALL_AXES(current_position,float);
+	plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
 
-						heater->temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (int)heater->PID_I;
-						heater->temp_iState_min = heater->temp_iState_max * (-1);
-					}
-					break;
-				}
-				case 303: // M303 PID autotune
-				{
-					heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
+	return SEND_REPLY;
+}
 
-					if (heater)
-					{
+//M20 - list sd files
+static int gcode_m20()
+{
+	sdcard_listfiles();
+	return NO_REPLY;
+}
 
-						float help_temp = 150.0;
+//M21 - init sd card
+static int gcode_m21()
+{
+	sdcard_mount();
+	return SEND_REPLY;
+}
 
-						if (has_code('S')) 
-							help_temp=get_float('S');
+//M22 - release sd card
+static int gcode_m22()
+{
+	sdcard_unmount();
+	return SEND_REPLY;
+}
 
-						PID_autotune(heater, help_temp);
-					}
-					return NO_REPLY;
-				}
-				case 304: // M304 Evaluate heater performance
-				{
-					heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
+//M23 - select sd file
+static int gcode_m23()
+{
+	sdcard_selectfile(get_str(' '));
+	return SEND_REPLY;
+}
 
-					if (heater)
-					{
-						unsigned int step = 10;
+//M24 - start/resume sd print
+static int gcode_m24()
+{
+	sdcard_replaystart();
+	return SEND_REPLY;
+}
 
-						if (has_code('S')) 
-							step=get_uint('S');
+//M25 - pause sd print
+static int gcode_m25()
+{
+	sdcard_replaypause();
+	return SEND_REPLY;
+}
 
-						Heater_Eval(heater, step);
-					}
-					return NO_REPLY;
-				}
-				case 400: // M400 finish all moves
-				{
-					st_synchronize();	
-					break;
+//M26 - set sd position
+static int gcode_m26()
+{
+	if (has_code('S'))
+		sdcard_setposition(get_uint('S'));
+	return SEND_REPLY;
+}
 
-				}
-				case 350: // Set microstepping mode (1=full step, 2=1/2 step, 4=1/4 step, 16=1/16 step).
-				//Warning: Steps per unit remains unchanged. 
-				// M350 X[value] Y[value] Z[value] E[value] B[value] 
-				// M350 S[value] set all motors
-				{
-					int cnt_c;
-					for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
-					{
-						if(has_code(axis_codes[cnt_c])) 
-						{
-							pa.axis_ustep[cnt_c] = microstep_mode(get_uint(axis_codes[cnt_c]));
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					
-					if(has_code('B'))
-					{
-						pa.axis_ustep[4] = microstep_mode(get_uint('B'));
-						motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
-					}
-					 
-					if(has_code('S'))
-					{
-						for(cnt_c=0; cnt_c<5; cnt_c++)
-						{
-							pa.axis_ustep[cnt_c] = microstep_mode(get_uint('S'));
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					break;
-				}
-				case 500: // M500 - stores paramters in EEPROM
-					FLASH_StoreSettings();
-					break;
-				case 501: // M501 - reads parameters from EEPROM (if you need to reset them after you changed them temporarily).
-					FLASH_LoadSettings();
-					break;
-				case 502:	// M502 - reverts to the default "factory settings". You still need to store them in EEPROM afterwards if you want to.
-					init_parameters();
-					break;
-				case 503:	//M503 show settings
-					FLASH_PrintSettings();
-					break;
-				case 505:
-					FLASH_Store_to_SD();
-					break;
-				case 510: // M510 Axis invert
-					if(has_code('X'))
-						pa.invert_x_dir = get_bool('X');
+//M27 - sd print status
+static int gcode_m27()
+{
+	sdcard_printstatus();
+	return NO_REPLY;
+}
 
-					if(has_code('Y'))
-						pa.invert_y_dir = get_bool('Y');
+//M28 - begin write to sd file
+static int gcode_m28()
+{
+	//sdcard_selectfile();
+	sdcard_capturestart(get_str(' '));
+	return SEND_REPLY;
+}
 
-					if(has_code('Z'))
-						pa.invert_z_dir = get_bool('Z');
+//M29 - stop writing sd file
+static int gcode_m29()
+{
+	sdcard_capturestop();
+	return SEND_REPLY;
+}
 
-					if(has_code('E'))
-						pa.invert_e_dir = get_bool('E');
+//M44 - Boot From ROM (load bootloader for uploading firmware)
+static int gcode_m44()
+{
+	if (strcmp(get_str(' '),"IKnowWhatIAmDoing") == 0)
+	{
+		FLASH_BootFromROM();
+		sendReply("bootloader enabled\n\r")
+	}
+	else
+	{
+		FLASH_BootFromFLASH();
+	}
+	return SEND_REPLY;
+}
 
-					break;
-				case 520: // M520 Maximum Area unit
-					if(has_code('X'))
-						pa.x_max_length = get_int('X');
+//M82 - Set E codes absolute (default)
+static int gcode_m82()
+{
+	axis_relative_modes[3] = 0;
+	return SEND_REPLY;
+}
 
-					if(has_code('Y'))
-						pa.y_max_length = get_int('Y');
+//M83 - Set E codes relative while in Absolute Coordinates (G90) mode
+static int gcode_m83()
+{
+	axis_relative_modes[3] = 1;
+	return SEND_REPLY;
+}
 
-					if(has_code('Z'))
-						pa.z_max_length = get_int('Z');
+//M84 - Disable steppers until next move, S<seconds> sets the inactivity timeout
+static int gcode_m84()
+{
+	st_synchronize(); // wait for all movements to finish
+	if(has_code('S'))
+	{
+		stepper_inactive_time = get_uint('S') * 1000; 
+	}
+	else if(has_code('T'))
+	{
+		enable_x(); 
+		enable_y(); 
+		enable_z(); 
+		enable_e(); 
+	}
+	else
+	{ 
+		disable_x(); 
+		disable_y(); 
+		disable_z(); 
+		disable_e(); 
+	}
+	return SEND_REPLY;
+}
 
-					break;
-				case 521: // M521 Disable axis when unused
-					if(has_code('X'))
-						pa.disable_x_en = get_bool('X');
+//M85 - Set inactivity shutdown timer with parameter S<seconds>
+static int gcode_m85()
+{
+	if (has_code('S'))
+		max_inactive_time = get_uint('S') * 1000; 
+	return SEND_REPLY;
+}
 
-					if(has_code('Y'))
-						pa.disable_y_en = get_bool('Y');
+//M92 - Set axis_steps_per_unit - same syntax as G92
+static int gcode_m92()
+{
+	int cnt_c;
+	for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
+	{
+		if(has_code(axis_codes[cnt_c])) 
+		{
+			pa.axis_steps_per_unit[cnt_c] = get_float(axis_codes[cnt_c]);
+			axis_steps_per_sqr_second[cnt_c] = pa.max_acceleration_units_per_sq_second[cnt_c] * pa.axis_steps_per_unit[cnt_c];
+		}
+	}
+	return SEND_REPLY;
+}
 
-					if(has_code('Z'))
-						pa.disable_z_en = get_bool('Z');
+//M93 - Show current axis steps
+static int gcode_m93()
+{
+	sendReply("X:%d Y:%d Z:%d E:%d",(int)pa.axis_steps_per_unit[0],(int)pa.axis_steps_per_unit[1],(int)pa.axis_steps_per_unit[2],(int)pa.axis_steps_per_unit[3]);
+	return SEND_REPLY;
+}
 
-					if(has_code('E'))
-						pa.disable_e_en = get_bool('E');
+//M104 - Set extruder target temp
+static int gcode_m104()
+{
+	if (has_code('S'))
+	{
+		heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
+		if (heater)
+			heater->target_temp = get_uint('S');
+	}
+	return SEND_REPLY;
+}
 
-					break;
-				case 522: // M522 Software Endstop
-					if(has_code('I'))
-						pa.min_software_endstops = get_bool('I');
+//M105 - Read current temp
+static int gcode_m105()
+{
+	heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
 
-					if(has_code('A'))
-						pa.max_software_endstops = get_bool('A');
+	if (heater)
+	{
+		const char* ok = (sdcard_isreplaying()) ? "" : "ok ";
+		sendReply("%sT:%u @%u B:%u \r\n",ok,heater->akt_temp,heater->pwm,bed_heater.akt_temp);
+	}
+	return NO_REPLY;
+}
 
-					break;
-				case 523: // M523 MIN Endstop
-					if(has_code('X'))
-						pa.x_min_endstop_aktiv = get_int('X')==1 ? 1 : -1;
+//M106 - Fan 1 on
+static int gcode_m106()
+{
+	if (has_code('S'))
+	{
+		g_pwm_value[2] = constrain(get_uint('S'),0,255);		  
+	}
+	else 
+	{
+		g_pwm_value[2] = 255;
+	}
+	g_pwm_aktiv[2] = 1;
+	return SEND_REPLY;
+}
 
-					if(has_code('Y'))
-						pa.y_min_endstop_aktiv = get_int('Y')==1 ? 1 : -1;
+//M107 - Fan 1 off
+static int gcode_m107()
+{
+	g_pwm_value[2] = 0;
+	return SEND_REPLY;
+}
 
-					if(has_code('Z'))
-						pa.z_min_endstop_aktiv = get_int('Z')==1 ? 1 : -1;
+//set a hotend target. with HEATUP_FINISH_TOGETHER the target is held back while the wait
+//includes a bed that is still heating up, see gcode_heatup_update()
+static void gcode_set_hotend_target(heater_struct* heater,int target,int withBed)
+{
+#ifdef HEATUP_FINISH_TOGETHER
+	if (withBed && bed_heater.akt_temp < bed_heater.target_temp && heater->akt_temp < target)
+	{
+		parserState.heatup.heldHeater = heater;
+		parserState.heatup.heldTarget = target;
+		return;
+	}
+#endif
+	heater->target_temp = target;
+}
 
-					break;
-				case 524: // M524 MAX Endstop
-					if(has_code('X'))
-						pa.x_max_endstop_aktiv = get_int('X')==1 ? 1 : -1;
+//called by the heater waits: measure the heating rates and release a held back hotend target
+//once the bed needs about as long as the hotend to reach its target
+static void gcode_heatup_update()
+{
+	HeatupState* heatup = &parserState.heatup;
+	heater_struct* hotend = parserState.wait.heater;
+	uint32_t interval = timestamp - heatup->lastSample;
+	
+	if (interval >= HEATUP_SAMPLE_INTERVAL)
+	{
+		float seconds = interval / 1000.0;
+		
+		if (heatup->lastSample != 0 && bed_heater.akt_temp < bed_heater.target_temp)
+		{
+			float rate = (bed_heater.akt_temp - heatup->lastBedTemp) / seconds;
+			heatup->bedRate = (heatup->bedRate > 0) ? (heatup->bedRate*3 + rate) / 4 : rate;
+		}
+		if (heatup->lastSample != 0 && hotend && hotend != heatup->heldHeater && hotend->akt_temp < hotend->target_temp - TEMP_HYSTERESIS)
+		{
+			float rate = (hotend->akt_temp - heatup->lastHotendTemp) / seconds;
+			heatup->hotendRate = (heatup->hotendRate > 0) ? (heatup->hotendRate*3 + rate) / 4 : rate;
+		}
+		heatup->lastBedTemp = bed_heater.akt_temp;
+		heatup->lastHotendTemp = hotend ? hotend->akt_temp : 0;
+		heatup->lastSample = timestamp;
+	}
+	
+	if (heatup->heldHeater)
+	{
+		int bedRemaining = bed_heater.target_temp - bed_heater.akt_temp;
+		int hotendRemaining = heatup->heldTarget - heatup->heldHeater->akt_temp;
+		float hotendRate = (heatup->hotendRate > 0.1) ? heatup->hotendRate : HOTEND_HEATUP_RATE;
+		
+		if (bedRemaining <= 0 || hotendRemaining <= 0 || (heatup->bedRate > 0 && bedRemaining / heatup->bedRate <= hotendRemaining / hotendRate))
+		{
+			heatup->heldHeater->target_temp = heatup->heldTarget;
+			heatup->heldHeater = NULL;
+		}
+	}
+}
+
+//M109 - Wait for extruder heater to reach target.
+static int gcode_wait_heater()
+{
+	WaitState* wait = &parserState.wait;
+	heater_struct* heater = wait->heater;
+	int bedPending = parserState.heatup.bedPending;
+	
+	gcode_heatup_update();
+	if (heater->akt_temp < wait->min_target || heater->akt_temp > wait->max_target
+		|| (bedPending && bed_heater.akt_temp < bed_heater.target_temp))
+	{
+	#ifdef TEMP_RESIDENCY_TIME
+		wait->residencyStart = -1;
+	#endif
+		if( (timestamp - wait->lastReport) > 1000 ) //Print Temp Reading every 1 second while heating up/cooling down
+		{
+			if (bedPending)
+			{
+				sendReport("T:%u B:%u\r\n",heater->akt_temp,bed_heater.akt_temp);
+			}
+			else
+			{
+				sendReport("T:%u \r\n",heater->akt_temp);
+			}
+			wait->lastReport = timestamp;
+		}
+		return false;
+	}
+	
+#ifdef TEMP_RESIDENCY_TIME
+	//actual temperature must stay close to target for TEMP_RESIDENCY_TIME
+	if (wait->residencyStart < 0)
+		wait->residencyStart = timestamp;
+	
+	if ((timestamp - wait->residencyStart) <= TEMP_RESIDENCY_TIME*1000)
+		return false;
+#endif
+	parserState.heatup.bedPending = false;
+	return true;
+}
+
+static int gcode_m109()
+{
+	heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
+
+	if (heater)
+	{
+		WaitState* wait = &parserState.wait;
+		int target = heater->target_temp;
+
+		if (has_code('S'))
+		{
+			target = get_uint('S');
+			wait->min_target = target;
+		}
+		else
+		{
+			wait->min_target = target - TEMP_HYSTERESIS;
+		}
+		
+		wait->max_target = has_code('R') ? get_uint('R') : target + TEMP_HYSTERESIS;
+		gcode_set_hotend_target(heater,target,parserState.heatup.bedPending);
+		wait->heater = heater;
+		wait->residencyStart = -1;
+		wait->lastReport = timestamp;
+		
+		return gcode_start_wait(gcode_wait_heater);
+	}
+	return SEND_REPLY;
+}
+
+//M110 - Set current line number
+static int gcode_m110()
+{
+	return SEND_REPLY;
+}
+
+//M114 - Display current position
+static int gcode_m114()
+{
+	sendReply("X:%f Y:%f Z:%f E:%f ",current_position[0],current_position[1],current_position[2],current_position[3]);
+	return SEND_REPLY;			  
+}
+
+//M115 - Capabilities string
+static int gcode_m115()
+{
+	const char* ok = (sdcard_isreplaying()) ? "" : "ok ";
+	sendReply("%sFIRMWARE_NAME: Sprinter 4pi PROTOCOL_VERSION:1.0 MACHINE_TYPE:Prusa EXTRUDER_COUNT:%d\r\n", ok, MAX_EXTRUDER);
+	return NO_REPLY;
+}
+
+//M116 - Wait for all heaters to reach their targets, the bed only has to reach its target.
+static int gcode_wait_all()
+{
+	WaitState* wait = &parserState.wait;
+	int ready = bed_heater.akt_temp >= bed_heater.target_temp;
+	int i;
+	
+	gcode_heatup_update();
+	for (i = 0; i < MAX_EXTRUDER; i++)
+	{
+		heater_struct* heater = &heaters[i];
+		int target = (heater == parserState.heatup.heldHeater) ? parserState.heatup.heldTarget : heater->target_temp;
+		
+		if (target > 0 && (heater->akt_temp < target - TEMP_HYSTERESIS || heater->akt_temp > target + TEMP_HYSTERESIS))
+			ready = false;
+	}
+	
+	if (!ready)
+	{
+	#ifdef TEMP_RESIDENCY_TIME
+		wait->residencyStart = -1;
+	#endif
+		if( (timestamp - wait->lastReport) > 1000 )
+		{
+			if (wait->heater)
+			{
+				sendReport("T:%u B:%u\r\n",wait->heater->akt_temp,bed_heater.akt_temp);
+			}
+			else
+			{
+				sendReport("B:%u\r\n",bed_heater.akt_temp);
+			}
+			wait->lastReport = timestamp;
+		}
+		return false;
+	}
+	
+#ifdef TEMP_RESIDENCY_TIME
+	if (wait->residencyStart < 0)
+		wait->residencyStart = timestamp;
+	
+	if ((timestamp - wait->residencyStart) <= TEMP_RESIDENCY_TIME*1000)
+		return false;
+#endif
+	parserState.heatup.bedPending = false;
+	return true;
+}
+
+static int gcode_m116()
+{
+	heater_struct* heater = get_heater(GET('T',GET('P',active_extruder)));
+	WaitState* wait = &parserState.wait;
+	
+	//all targets are set before waiting, so bed and hotends heat up together
+	if (has_code('B'))
+		bed_heater.target_temp = get_uint('B');
+	if (heater && has_code('S'))
+		gcode_set_hotend_target(heater,get_uint('S'),true);
+	
+	wait->heater = heater;
+	wait->residencyStart = -1;
+	wait->lastReport = timestamp;
+	return gcode_start_wait(gcode_wait_all);
+}
+
+//M119 - Show endstop state
+static int gcode_m119()
+{
+	char read_endstops[6] = {'X','X','X','X','X','X'};
+  
+	if(pa.x_min_endstop_aktiv > -1)
+		read_endstops[0] = (PIO_Get(&X_MIN_PIN) ^ pa.x_endstop_invert) + 48;
+
+	if(pa.y_min_endstop_aktiv > -1)
+		read_endstops[1] = (PIO_Get(&Y_MIN_PIN) ^ pa.y_endstop_invert) + 48;
+
+	if(pa.z_min_endstop_aktiv > -1)
+		read_endstops[2] = (PIO_Get(&Z_MIN_PIN) ^ pa.z_endstop_invert) + 48;
+
+	if(pa.x_max_endstop_aktiv > -1)
+		read_endstops[3] = (PIO_Get(&X_MAX_PIN) ^ pa.x_endstop_invert) + 48;
+
+	if(pa.y_max_endstop_aktiv > -1)
+		read_endstops[4] = (PIO_Get(&Y_MAX_PIN) ^ pa.y_endstop_invert) + 48;
+
+	if(pa.z_max_endstop_aktiv > -1)
+		read_endstops[5] = (PIO_Get(&Z_MAX_PIN) ^ pa.z_endstop_invert) + 48; 
+
+
+	sendReply("Xmin:%c Ymin:%c Zmin:%c / Xmax:%c Ymax:%c Zmax:%c ",read_endstops[0],read_endstops[1],read_endstops[2],read_endstops[3],read_endstops[4],read_endstops[5]);
+	return SEND_REPLY;
+}
+
+//M140 - Set bed target temp
+static int gcode_m140()
+{
+	if (has_code('S')) 
+		bed_heater.target_temp = get_uint('S');
+
+	return SEND_REPLY;
+}
+
+//M176 - Fan 2 on
+static int gcode_m176()
+{
+	if (has_code('S'))
+	{
+		g_pwm_value[3] = constrain(get_uint('S'),0,255);		  
+	}
+	else 
+	{
+		g_pwm_value[3] = 255;
+	}
+	g_pwm_aktiv[3] = 1;
+	return SEND_REPLY;
+}
+
+//M177 - Fan 2 off
+static int gcode_m177()
+{
+	g_pwm_value[3] = 0;
+	return SEND_REPLY;
+}
+
+//M190 - Wait for bed heater to reach target temperature.
+static int gcode_wait_bed()
+{
+	WaitState* wait = &parserState.wait;
+	
+	if (bed_heater.akt_temp >= bed_heater.target_temp)
+	{
+		parserState.heatup.bedPending = false;
+		return true;
+	}
+	
+	if( (timestamp - wait->lastReport) > 1000 ) //Print Temp Reading every 1 second while heating up.
+	{
+		if (wait->heater)
+		{
+			sendReport("T:%u B:%u\r\n",wait->heater->akt_temp,bed_heater.akt_temp);
+		}
+		wait->lastReport = timestamp; 
+	}
+	return false;
+}
+
+static int gcode_m190()
+{
+	if (has_code('S'))
+		bed_heater.target_temp = get_float('S');
+
+	parserState.wait.heater = get_heater(GET('T',GET('P',active_extruder)));
+	parserState.wait.lastReport = timestamp;
+	
+#ifdef CONCURRENT_HEATUP
+	//let the hotend heat up meanwhile, see gcode_check_heatup()
+	if (bed_heater.akt_temp < bed_heater.target_temp)
+	{
+		parserState.heatup.bedPending = true;
+		return SEND_REPLY;
+	}
+#endif
+	return gcode_start_wait(gcode_wait_bed);
+}
+
+//M201 - Set maximum acceleration in units/s^2 for print moves (M201 X1000 Y1000)
+static int gcode_m201()
+{
+	int cnt_c;
+	for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
+	{
+		if(has_code(axis_codes[cnt_c]))
+		{
+			float acc = get_float(axis_codes[cnt_c]);
+			pa.max_acceleration_units_per_sq_second[cnt_c] = acc;
+			axis_steps_per_sqr_second[cnt_c] = acc * pa.axis_steps_per_unit[cnt_c];
+		}
+	}
+	return SEND_REPLY;
+}
+
+//M202 - Max feedrate mm/sec
+static int gcode_m202()
+{
+	GET_ALL_AXES(pa.max_feedrate,float);
+	return SEND_REPLY;
+}
+
+//M203 - Temperature monitor
+static int gcode_m203()
+{
+	//if(code_seen('S')) manage_monitor = code_value();
+	//if(manage_monitor==100) manage_monitor=1; // Set 100 to heated bed
+	return SEND_REPLY;
+}
+
+//M204 - Acceleration S normal moves T filmanent only moves
+static int gcode_m204()
+{
+	if(has_code('S')) 
+		pa.move_acceleration = get_float('S');
+
+	if(has_code('T'))
+		pa.retract_acceleration = get_float('T');
+	return SEND_REPLY;
+}
+
+//M205 - Advanced settings: minimum travel speed S=while printing T=travel only, B=minimum segment time X= maximum xy jerk, Z=maximum Z jerk, E= max E jerk
+static int gcode_m205()
+{
+	if(has_code('S')) 
+		pa.minimumfeedrate = get_float('S');
+
+	if(has_code('T')) 
+		pa.mintravelfeedrate = get_float('T');
+	//if(code_seen('B')) minsegmenttime = code_value() ;
+
+	if(has_code('X')) 
+		pa.max_xy_jerk = get_float('X');
+
+	if(has_code('Z'))
+		pa.max_z_jerk = get_float('Z');
+
+	if(has_code('E'))
+		pa.max_e_jerk = get_float('E');
+	return SEND_REPLY;
+}
+
+//M206 - Additional homing offset
+static int gcode_m206()
+{
+	GET_AXES(pa.add_homing,float,3);
+	return SEND_REPLY;
+}
+
+//M207 - Homing Feedrate mm/min Xnnn Ynnn Znnn
+static int gcode_m207()
+{
+	GET_AXES(pa.homing_feedrate,float,3);
+	return SEND_REPLY;
+}
+
+//M220 - S<factor in percent> set speed factor override percentage
+static int gcode_m220()
+{
+	if(has_code('S')) 
+	{
+		feedmultiply = constrain(get_uint('S'), 20, 200);
+		feedmultiplychanged=1;
+	}
+	return SEND_REPLY;
+}
+
+//M221 - S<factor in percent> set extrude factor override percentage
+static int gcode_m221()
+{
+	if(has_code('S')) 
+	{
+		extrudemultiply = constrain(get_uint('S'), 40, 200);
+	}
+	return SEND_REPLY;
+}
+
+//M301 - Set Heater parameters P, I, D, S (slope), B (y-intercept), W (maximum pwm), F (extrusion feed-forward)
+static int gcode_m301()
+{
+	int extruder = GET('T',active_extruder);
+	heater_struct* heater = get_heater(extruder);
+
+	if (heater)
+	{
+		if(has_code('P'))
+			heater->PID_Kp = pa.heater_pTerm[extruder] = get_uint('P');
+
+		if(has_code('I'))
+			heater->PID_I	 = pa.heater_iTerm[extruder] = get_uint('I');
+
+		if(has_code('D'))
+			heater->PID_Kd = pa.heater_dTerm[extruder] = get_uint('D');
+
+		if(has_code('F'))
+			heater->FF_gain = pa.heater_ff_gain[extruder] = get_uint('F');
+
+		if(has_code('S'))
+			heater->slope = pa.heater_slope[extruder] = get_uint('S');
+
+		if(has_code('B'))
+			heater->intercept = pa.heater_intercept[extruder] = get_uint('B');
+
+		if(has_code('W'))
+			heater->max_pwm = pa.heater_max_pwm[extruder] = get_uint('W');
+
+		heater_PID_limits(heater);
+	}
+	return SEND_REPLY;
+}
+
+//M303 - PID autotune, runs in the background. C1 cancels it.
+static int gcode_m303()
+{
+	heater_struct* heater = (has_code('B') && get_int('B')) ? &bed_heater : get_heater(GET('T',GET('P',active_extruder)));
+
+	if (has_code('C') && get_int('C'))
+	{
+		PID_autotune_cancel();
+		return SEND_REPLY;
+	}
+
+	if (heater)
+	{
+
+		float help_temp = 150.0;
+
+		if (has_code('S')) 
+			help_temp=get_float('S');
+
+		if (!PID_autotune(heater, help_temp))
+			sendReply("PID Autotune already running\r\n");
+	}
+	return SEND_REPLY;
+}
+
+//M304 - Set Heatbed PID parameters P, I, D
+static int gcode_m304()
+{
+	if(has_code('P'))
+		bed_heater.PID_Kp = pa.bed_pTerm = get_uint('P');
+
+	if(has_code('I'))
+		bed_heater.PID_I = pa.bed_iTerm = get_uint('I');
+
+	if(has_code('D'))
+		bed_heater.PID_Kd = pa.bed_dTerm = get_uint('D');
+
+	heater_PID_limits(&bed_heater);
+	return SEND_REPLY;
+}
+
+//M306 - Calibrate slope and y-intercept of a heater, runs in the background. C1 cancels it.
+static int gcode_m306()
+{
+	int extruder = GET('T',GET('P',active_extruder));
+
+	if (has_code('C') && get_int('C'))
+	{
+		Heater_Eval_cancel();
+		return SEND_REPLY;
+	}
+
+	if (get_heater(extruder))
+	{
+		int high = GET('S',200);
+		int low = GET('L',HEATER_CAL_LOW);
+		int points = GET('N',4);
+
+		if (!Heater_Eval(extruder, low, high, points))
+			sendReply("Heater evaluation or autotune already running\r\n");
+	}
+	return SEND_REPLY;
+}
+
+//M400 - Finish all moves
+static int gcode_wait_moves()
+{
+	return !blocks_queued();
+}
+
+static int gcode_m400()
+{
+	return gcode_start_wait(gcode_wait_moves);
+}
+
+//M350 - Set microstepping mode (1=full step, 2=1/2 step, 4=1/4 step, 16=1/16 step).
+//Warning: Steps per unit remains unchanged.
+//M350 X[value] Y[value] Z[value] E[value] B[value]
+//M350 S[value] set all motors
+//M350 R[1/16 steps per second] X, Y and Z switch to 1/4 steps above this speed, 0 = never
+static int gcode_m350()
+{
+	int cnt_c;
+	
+	//X, Y and Z may be in 1/4 steps for a fast move, their pins are changed once stopped
+	if(has_code('X') || has_code('Y') || has_code('Z') || has_code('S'))
+		stepper_ustep_sync();
+	
+	for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
+	{
+		if(has_code(axis_codes[cnt_c])) 
+		{
+			pa.axis_ustep[cnt_c] = microstep_mode(get_uint(axis_codes[cnt_c]));
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+	
+	if(has_code('B'))
+	{
+		pa.axis_ustep[4] = microstep_mode(get_uint('B'));
+		motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
+	}
+	 
+	if(has_code('S'))
+	{
+		for(cnt_c=0; cnt_c<5; cnt_c++)
+		{
+			pa.axis_ustep[cnt_c] = microstep_mode(get_uint('S'));
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+
+	if(has_code('R'))
+		pa.ustep_switch_rate = get_uint('R');
+	return SEND_REPLY;
+}
+
+//M500 - stores paramters in EEPROM
+static int gcode_m500()
+{
+	FLASH_StoreSettings();
+	return SEND_REPLY;
+}
+
+//M501 - reads parameters from EEPROM (if you need to reset them after you changed them temporarily).
+static int gcode_m501()
+{
+	FLASH_LoadSettings();
+	return SEND_REPLY;
+}
+
+//M502 - reverts to the default "factory settings". You still need to store them in EEPROM afterwards if you want to.
+static int gcode_m502()
+{
+	init_parameters();
+	return SEND_REPLY;
+}
+
+//M503 - Show settings
+static int gcode_m503()
+{
+	FLASH_PrintSettings();
+	return SEND_REPLY;
+}
+
+//M505 - Save Parameters to SD-Card
+static int gcode_m505()
+{
+	FLASH_Store_to_SD();
+	return SEND_REPLY;
+}
+
+//M510 - Axis invert
+static int gcode_m510()
+{
+	if(has_code('X'))
+		pa.invert_x_dir = get_bool('X');
+
+	if(has_code('Y'))
+		pa.invert_y_dir = get_bool('Y');
+
+	if(has_code('Z'))
+		pa.invert_z_dir = get_bool('Z');
+
+	if(has_code('E'))
+		pa.invert_e_dir = get_bool('E');
+
+	return SEND_REPLY;
+}
+
+//M520 - Maximum Area unit
+static int gcode_m520()
+{
+	if(has_code('X'))
+		pa.x_max_length = get_int('X');
+
+	if(has_code('Y'))
+		pa.y_max_length = get_int('Y');
+
+	if(has_code('Z'))
+		pa.z_max_length = get_int('Z');
+
+	return SEND_REPLY;
+}
+
+//M521 - Disable axis when unused
+static int gcode_m521()
+{
+	if(has_code('X'))
+		pa.disable_x_en = get_bool('X');
+
+	if(has_code('Y'))
+		pa.disable_y_en = get_bool('Y');
+
+	if(has_code('Z'))
+		pa.disable_z_en = get_bool('Z');
+
+	if(has_code('E'))
+		pa.disable_e_en = get_bool('E');
+
+	return SEND_REPLY;
+}
+
+//M522 - Software Endstop
+static int gcode_m522()
+{
+	if(has_code('I'))
+		pa.min_software_endstops = get_bool('I');
+
+	if(has_code('A'))
+		pa.max_software_endstops = get_bool('A');
+
+	return SEND_REPLY;
+}
+
+//M523 - MIN Endstop
+static int gcode_m523()
+{
+	if(has_code('X'))
+		pa.x_min_endstop_aktiv = get_int('X')==1 ? 1 : -1;
+
+	if(has_code('Y'))
+		pa.y_min_endstop_aktiv = get_int('Y')==1 ? 1 : -1;
+
+	if(has_code('Z'))
+		pa.z_min_endstop_aktiv = get_int('Z')==1 ? 1 : -1;
+
+	return SEND_REPLY;
+}
+
+//M524 - MAX Endstop
+static int gcode_m524()
+{
+	if(has_code('X'))
+		pa.x_max_endstop_aktiv = get_int('X')==1 ? 1 : -1;
+
+	if(has_code('Y'))
+		pa.y_max_endstop_aktiv = get_int('Y')==1 ? 1 : -1;
+
+	if(has_code('Z'))
+		pa.z_max_endstop_aktiv = get_int('Z')==1 ? 1 : -1;
+
+	return SEND_REPLY;
+}
+
+//M525 - Homing Direction
+static int gcode_m525()
+{
+	if(has_code('X'))
+		pa.x_home_dir = get_int('X')==1 ? 1 : -1;
+
+	if(has_code('Y'))
+		pa.y_home_dir = get_int('Y')==1 ? 1 : -1;
+
+	if(has_code('Z'))
+		pa.z_home_dir = get_int('Z')==1 ? 1 : -1;
+
+	return SEND_REPLY;
+}
+
+//M526 - Endstop Invert
+static int gcode_m526()
+{
+	if(has_code('X'))
+		pa.x_endstop_invert = get_bool('X');
+
+	if(has_code('Y'))
+		pa.y_endstop_invert = get_bool('Y');
+
+	if(has_code('Z'))
+		pa.z_endstop_invert = get_bool('Z');
+
+	return SEND_REPLY;
+}
+
+//M530 - Heater Sensor
+static int gcode_m530()
+{
+	int extruder = GET('T',GET('P',active_extruder));
+	heater_struct* heater = get_heater(extruder);
+
+	if (heater)
+	{
+		if(has_code('E')) 
+		{
+			heater->thermistor_type = pa.heater_thermistor_type[extruder] = get_uint('E');
+			temp_table_build(extruder,heater->thermistor_type);
+		}
+	}
+	
+	if(has_code('B')) 
+	{
+		bed_heater.thermistor_type = pa.bed_thermistor_type = get_uint('B');
+		temp_table_build(TEMP_SENSOR_BED,bed_heater.thermistor_type);
+	}
+	
+	return SEND_REPLY;
+}
+
+//M531 - Heater PWM
+static int gcode_m531()
+{
+	int extruder = GET('T',GET('P',active_extruder));
+	heater_struct* heater = get_heater(extruder);
+
+	if (heater)
+	{
+		if(has_code('E')) 
+			heater->soft_pwm_aktiv = pa.heater_pwm_en[extruder] = get_bool('E');
+	}
+	
+	return SEND_REPLY;
+}
+
+//M560 - Raw binary upload, the parser is bypassed until all bytes are received
+//M560 S[bytes] [filename]
+static int gcode_m560()
+{
+	const char* size = get_str('S');
+	char* name = NULL;
+	char* end;
+	uint32_t bytes = 0;
+
+	//the name is the rest of the line after the byte count, without the blanks around it
+	if (size)
+	{
+		bytes = strtoul(size,&name,10);
+		if (name == size)
+			name = NULL;
+	}
+	if (name)
+	{
+		while (*name == ' ' || *name == '\t')
+			name++;
+		end = name + strlen(name);
+		while (end > name && (end[-1] == ' ' || end[-1] == '\t'))
+			*--end = 0;
+	}
+
+	if (!name || *name == 0)
+	{
+		sendReply("error: M560 S<bytes> <filename>\r\n");
+		return NO_REPLY;
+	}
+	sdcard_uploadstart(name,bytes);
+	return NO_REPLY;
+}
+
+//M630 - Binary move frames
+static int gcode_m630()
+{
+	if (has_code('S'))
+	{
+		parserState.binary_mode = get_bool('S');
+		parserState.binSeq = 0;
+	}
+	return SEND_REPLY;
+}
+
+//M632 - Show the runtime of each main loop task, S1 resets the counters
+static int gcode_m632()
+{
+	int i;
+	
+	if (get_bool('S'))
+	{
+		scheduler_reset_stats();
+		return SEND_REPLY;
+	}
+	
+	for (i=0;i<scheduler_task_count();i++)
+	{
+		const sched_task* task = scheduler_task(i);
+		unsigned int avg = task->runs ? scheduler_cycles_to_us(task->cycles / task->runs) : 0;
+		
+		sendReply("%s P%u runs:%u avg:%uus max:%uus late:%u\r\n",task->name,task->priority,(unsigned int)task->runs,
+			avg,(unsigned int)scheduler_cycles_to_us(task->max_cycles),(unsigned int)task->late);
+	}
+	return SEND_REPLY;
+}
+
+//M633 - Dump the heater log as CSV, oldest tick first. S1 clears it
+static int gcode_m633()
+{
+	unsigned int i;
+	
+	if (get_bool('S'))
+	{
+		heater_log_clear();
+		return SEND_REPLY;
+	}
+	
+	sendReply("time,heater,temp16,target,pwm,p,i,d,ff\r\n");
+	for (i=0;i<heater_log_count();i++)
+	{
+		const heater_log_entry* entry = heater_log_get(i);
+		
+		sendReply("%u,%u,%d,%d,%u,%d,%d,%d,%d\r\n",(unsigned int)entry->time,entry->heater,entry->akt_temp16,entry->target_temp,
+			entry->pwm,entry->pTerm,entry->iTerm,entry->dTerm,entry->ffTerm);
+	}
+	return SEND_REPLY;
+}
+
+//M906 - set motor current value in mA using axis codes
+//M906 X[mA] Y[mA] Z[mA] E[mA] B[mA]
+//M906 S[mA] set all motors current
+static int gcode_m906()
+{
+	int cnt_c;
+	unsigned int ma;
+
+	for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
+	{
+		if(has_code(axis_codes[cnt_c])) 
+		{
+			ma = constrain(get_uint(axis_codes[cnt_c]),0,1900);
+			pa.axis_current[cnt_c] = ma_count(ma);
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+	
+	if(has_code('B'))
+	{
+		ma = constrain(get_uint('B'),0,1900);
+		pa.axis_current[4] = ma_count(ma);
+		motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
+	}
+	  
+	if(has_code('S'))
+	{
+		for(cnt_c=0; cnt_c<5; cnt_c++)
+		{
+			ma = constrain(get_uint('S'),0,1900);
+			pa.axis_current[cnt_c] = ma_count(ma);
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+	return SEND_REPLY;
+}
+
+//M907 - set motor current value (0-255) using axis codes
+//M907 X[value] Y[value] Z[value] E[value] B[value]
+//M907 S[value] set all motors current
+static int gcode_m907()
+{
+	int cnt_c;
+	for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
+	{
+		if(has_code(axis_codes[cnt_c])) 
+		{
+			pa.axis_current[cnt_c] = constrain(get_uint(axis_codes[cnt_c]),0,255);
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+	  
+	if(has_code('B'))
+	{
+		pa.axis_current[4] = constrain(get_uint('B'),0,255);
+		motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
+	}
+	  
+	if(has_code('S'))
+	{
+		for(cnt_c=0; cnt_c<5; cnt_c++)
+		{
+			pa.axis_current[cnt_c] = constrain(get_uint('S'),0,255);
+			motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
+		}
+	}
+	return SEND_REPLY;	  
+}
 
-					if(has_code('Y'))
-						pa.y_max_endstop_aktiv = get_int('Y')==1 ? 1 : -1;
+//M909 - set dynamic motor current
+//M909 I[percent] A[percent] S[seconds]
+static int gcode_m909()
+{
+	if(has_code('I'))
+		pa.motor_idle_current = constrain(get_uint('I'),0,100);
 
-					if(has_code('Z'))
-						pa.z_max_endstop_aktiv = get_int('Z')==1 ? 1 : -1;
+	if(has_code('A'))
+		pa.motor_boost_current = constrain(get_uint('A'),100,200);
 
-					break;
-				case 525: // M525 Homing Direction
-					if(has_code('X'))
-						pa.x_home_dir = get_int('X')==1 ? 1 : -1;
+	if(has_code('S'))
+		pa.motor_idle_time = constrain(get_uint('S'),0,65535);
 
-					if(has_code('Y'))
-						pa.y_home_dir = get_int('Y')==1 ? 1 : -1;
+	return SEND_REPLY;
+}
 
-					if(has_code('Z'))
-						pa.z_home_dir = get_int('Z')==1 ? 1 : -1;
+//T<n> - Select extruder
+static int gcode_t()
+{
+	int new_extruder = get_uint('T');
+	if (new_extruder >= MAX_EXTRUDER)
+	{
+		sendReply("Invalid extruder\n\r");
+	}
+	else
+		active_extruder = new_extruder;
+	
+	return SEND_REPLY;
+}
 
-					break;
-				case 526: // M526 Endstop Invert
-					if(has_code('X'))
-						pa.x_endstop_invert = get_bool('X');
+//M631 - Show how often each command has been executed, S1 resets the counters
+static int gcode_m631();
 
-					if(has_code('Y'))
-						pa.y_endstop_invert = get_bool('Y');
+#define P(letter) (1UL << ((letter) - 'A'))
+#define AXES (P('X')|P('Y')|P('Z')|P('E'))
 
-					if(has_code('Z'))
-						pa.z_endstop_invert = get_bool('Z');
+//command is executed while writing to sd card instead of being written to the file
+#define GC_SD_CONTROL 0x01
+//command may run while a bed heat-up is pending, see gcode_check_heatup()
+#define GC_HEATUP 0x02
 
-					break;
-				case 530: // M530 Heater Sensor
-				{
-					int extruder = GET('T',GET('P',active_extruder));
-					heater_struct* heater = get_heater(extruder);
-
-					if (heater)
-					{
-						if(has_code('E')) 
-							heater->thermistor_type = pa.heater_thermistor_type[extruder] = get_uint('E');
-					}
-					
-					if(has_code('B')) 
-						bed_heater.thermistor_type = pa.bed_thermistor_type = get_uint('B');
-					
-					break;
-				}
+typedef struct
+{
+	char letter;
+	uint16_t number;
+	uint32_t params;		//parameter letters used by the handler, see gcode_tokenize()
+	uint8_t flags;
+	int (*handler)();
+} GCodeCommand;
+
+//sorted by letter and number, looked up with a binary search.
+//T<n> selects a tool, the number is handled as a parameter.
+static const GCodeCommand gcode_commands[] = {
+	{'G',   0, AXES|P('F'), 0, gcode_g1},
+	{'G',   1, AXES|P('F'), 0, gcode_g1},
+	{'G',   2, AXES|P('F')|P('I')|P('J'), 0, gcode_g2},
+	{'G',   3, AXES|P('F')|P('I')|P('J'), 0, gcode_g3},
+	{'G',   4, P('P')|P('S'), 0, gcode_g4},
+	{'G',  21, 0, GC_HEATUP, gcode_g21},
+	{'G',  28, AXES, 0, gcode_g28},
+	{'G',  90, 0, GC_HEATUP, gcode_g90},
+	{'G',  91, 0, GC_HEATUP, gcode_g91},
+	{'G',  92, AXES, 0, gcode_g92},
+	{'M',  20, 0, GC_SD_CONTROL, gcode_m20},
+	{'M',  21, 0, GC_SD_CONTROL, gcode_m21},
+	{'M',  22, 0, GC_SD_CONTROL, gcode_m22},
+	{'M',  23, 0, GC_SD_CONTROL, gcode_m23},
+	{'M',  24, 0, GC_SD_CONTROL, gcode_m24},
+	{'M',  25, 0, GC_SD_CONTROL, gcode_m25},
+	{'M',  26, P('S'), GC_SD_CONTROL, gcode_m26},
+	{'M',  27, 0, GC_SD_CONTROL, gcode_m27},
+	{'M',  28, 0, GC_SD_CONTROL, gcode_m28},
+	{'M',  29, 0, GC_SD_CONTROL, gcode_m29},
+	{'M',  44, 0, 0, gcode_m44},
+	{'M',  82, 0, GC_HEATUP, gcode_m82},
+	{'M',  83, 0, GC_HEATUP, gcode_m83},
+	{'M',  84, P('S')|P('T'), 0, gcode_m84},
+	{'M',  85, P('S'), 0, gcode_m85},
+	{'M',  92, AXES, 0, gcode_m92},
+	{'M',  93, 0, 0, gcode_m93},
+	{'M', 104, P('P')|P('S')|P('T'), GC_HEATUP, gcode_m104},
+	{'M', 105, P('P')|P('T'), GC_HEATUP, gcode_m105},
+	{'M', 106, P('S'), GC_HEATUP, gcode_m106},
+	{'M', 107, 0, GC_HEATUP, gcode_m107},
+	{'M', 109, P('P')|P('R')|P('S')|P('T'), GC_HEATUP, gcode_m109},
+	{'M', 110, 0, GC_HEATUP, gcode_m110},
+	{'M', 114, 0, GC_HEATUP, gcode_m114},
+	{'M', 115, 0, GC_HEATUP, gcode_m115},
+	{'M', 116, P('B')|P('P')|P('S')|P('T'), GC_HEATUP, gcode_m116},
+	{'M', 119, 0, GC_HEATUP, gcode_m119},
+	{'M', 140, P('S'), GC_HEATUP, gcode_m140},
+	{'M', 176, P('S'), 0, gcode_m176},
+	{'M', 177, 0, 0, gcode_m177},
+	{'M', 190, P('P')|P('S')|P('T'), GC_HEATUP, gcode_m190},
+	{'M', 201, AXES, 0, gcode_m201},
+	{'M', 202, AXES, 0, gcode_m202},
+	{'M', 203, 0, 0, gcode_m203},
+	{'M', 204, P('S')|P('T'), 0, gcode_m204},
+	{'M', 205, P('E')|P('S')|P('T')|P('X')|P('Z'), 0, gcode_m205},
+	{'M', 206, P('X')|P('Y')|P('Z'), 0, gcode_m206},
+	{'M', 207, P('X')|P('Y')|P('Z'), 0, gcode_m207},
+	{'M', 220, P('S'), 0, gcode_m220},
+	{'M', 221, P('S'), 0, gcode_m221},
+	{'M', 301, P('B')|P('D')|P('F')|P('I')|P('P')|P('S')|P('T')|P('W'), 0, gcode_m301},
+	{'M', 303, P('B')|P('C')|P('P')|P('S')|P('T'), 0, gcode_m303},
+	{'M', 304, P('D')|P('I')|P('P'), 0, gcode_m304},
+	{'M', 306, P('C')|P('L')|P('N')|P('P')|P('S')|P('T'), 0, gcode_m306},
+	{'M', 350, AXES|P('B')|P('S')|P('R'), 0, gcode_m350},
+	{'M', 400, 0, 0, gcode_m400},
+	{'M', 500, 0, 0, gcode_m500},
+	{'M', 501, 0, 0, gcode_m501},
+	{'M', 502, 0, 0, gcode_m502},
+	{'M', 503, 0, 0, gcode_m503},
+	{'M', 505, 0, 0, gcode_m505},
+	{'M', 510, AXES, 0, gcode_m510},
+	{'M', 520, P('X')|P('Y')|P('Z'), 0, gcode_m520},
+	{'M', 521, AXES, 0, gcode_m521},
+	{'M', 522, P('A')|P('I'), 0, gcode_m522},
+	{'M', 523, P('X')|P('Y')|P('Z'), 0, gcode_m523},
+	{'M', 524, P('X')|P('Y')|P('Z'), 0, gcode_m524},
+	{'M', 525, P('X')|P('Y')|P('Z'), 0, gcode_m525},
+	{'M', 526, P('X')|P('Y')|P('Z'), 0, gcode_m526},
+	{'M', 530, P('B')|P('E')|P('P')|P('T'), 0, gcode_m530},
+	{'M', 531, P('E')|P('P')|P('T'), 0, gcode_m531},
+	{'M', 560, P('S'), GC_SD_CONTROL, gcode_m560},
+	{'M', 630, P('S'), 0, gcode_m630},
+	{'M', 631, P('S'), GC_HEATUP, gcode_m631},
+	{'M', 632, P('S'), GC_HEATUP, gcode_m632},
+	{'M', 633, P('S'), GC_HEATUP, gcode_m633},
+	{'M', 906, AXES|P('B')|P('S'), 0, gcode_m906},
+	{'M', 907, AXES|P('B')|P('S'), 0, gcode_m907},
+	{'M', 909, P('A')|P('I')|P('S'), 0, gcode_m909},
+	{'T',   0, 0, GC_HEATUP, gcode_t},
+};
+
+#define NUM_COMMANDS (sizeof(gcode_commands)/sizeof(gcode_commands[0]))
+
+//number of times each command has been executed, shown with M631
+static uint32_t commandHits[NUM_COMMANDS];
+
+static int gcode_m631()
+{
+	int i;
 	
-				case 531: // M531 Heater PWM
-				{
-					int extruder = GET('T',GET('P',active_extruder));
-					heater_struct* heater = get_heater(extruder);
-
-					if (heater)
-					{
-						if(has_code('E')) 
-							heater->pwm = pa.heater_pwm_en[extruder] = get_bool('E');
-					}
-					
-					break;
-				}
-				case 906: // set motor current value in mA using axis codes
-				// M906 X[mA] Y[mA] Z[mA] E[mA] B[mA] 
-				// M906 S[mA] set all motors current 
-				{
-					int cnt_c;
-					unsigned int ma;
-		
-					for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
-					{
-						if(has_code(axis_codes[cnt_c])) 
-						{
-							ma = constrain(get_uint(axis_codes[cnt_c]),0,1900);
-							pa.axis_current[cnt_c] = ma_count(ma);
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					
-					if(has_code('B'))
-					{
-						ma = constrain(get_uint('B'),0,1900);
-						pa.axis_current[4] = ma_count(ma);
-						motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
-					}
-					  
-					if(has_code('S'))
-					{
-						for(cnt_c=0; cnt_c<5; cnt_c++)
-						{
-							ma = constrain(get_uint('S'),0,1900);
-							pa.axis_current[cnt_c] = ma_count(ma);
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					break;
-				}
-				case 907: // set motor current value (0-255) using axis codes
-				// M907 X[value] Y[value] Z[value] E[value] B[value] 
-				// M907 S[value] set all motors current 
-				{
-					int cnt_c;
-					for(cnt_c=0; cnt_c < NUM_AXIS; cnt_c++) 
-					{
-						if(has_code(axis_codes[cnt_c])) 
-						{
-							pa.axis_current[cnt_c] = constrain(get_uint(axis_codes[cnt_c]),0,255);
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					  
-					if(has_code('B'))
-					{
-						pa.axis_current[4] = constrain(get_uint('B'),0,255);
-						motor_setopts(4,pa.axis_ustep[4],pa.axis_current[4]);
-					}
-					  
-					if(has_code('S'))
-					{
-						for(cnt_c=0; cnt_c<5; cnt_c++)
-						{
-							pa.axis_current[cnt_c] = constrain(get_uint('S'),0,255);
-							motor_setopts(cnt_c,pa.axis_ustep[cnt_c],pa.axis_current[cnt_c]);
-						}
-					}
-					break;	  
-				}
-			  default:
-					sendReply("Unknown M%d\n\r",get_int('M'));
-					return NO_REPLY;
-			}
-			break;
-		}
-		case 'T':
-		{
-			if (sdcard_iscapturing()) {
-				sdcard_writeline(parserState.parsePos);
-				break;
-			}
-			int new_extruder = get_uint('T');
-			if (new_extruder >= MAX_EXTRUDER)
-			{
-				sendReply("Invalid extruder\n\r");
-			}
-			else
-				active_extruder = new_extruder;
-			
-			break;
-		}
-		default:
-			sendReply("Unknown command %c\n\r",get_command());
-			return NO_REPLY;
+	if (get_bool('S'))
+	{
+		memset(commandHits,0,sizeof(commandHits));
+		return SEND_REPLY;
+	}
+	
+	for (i=0;i<NUM_COMMANDS;i++)
+	{
+		if (commandHits[i])
+			sendReply("%c%u: %u\r\n",gcode_commands[i].letter,gcode_commands[i].number,commandHits[i]);
 	}
 	return SEND_REPLY;
 }
 
+static const GCodeCommand* gcode_find_command(char letter,uint16_t number)
+{
+	uint32_t key = ((uint32_t)(uint8_t)letter << 16) | number;
+	int low = 0;
+	int high = NUM_COMMANDS - 1;
+	
+	while (low <= high)
+	{
+		int mid = (low + high) >> 1;
+		uint32_t midKey = ((uint32_t)(uint8_t)gcode_commands[mid].letter << 16) | gcode_commands[mid].number;
+		
+		if (midKey == key)
+			return &gcode_commands[mid];
+		if (midKey < key)
+			low = mid + 1;
+		else
+			high = mid - 1;
+	}
+	return NULL;
+}
+
+//process the actual gcode command
+static int gcode_process_command()
+{
+	char letter = get_command();
+	const GCodeCommand* cmd;
+	int32_t number = 0;
+	
+	if (letter != 'G' && letter != 'M' && letter != 'T')
+	{
+		sendReply("Unknown command %c\n\r",letter);
+		return NO_REPLY;
+	}
+	
+	if (letter != 'T')
+		number = strtol(parserState.parsePos+1,NULL,10);
+	
+	cmd = (number >= 0 && number <= 0xFFFF) ? gcode_find_command(letter,number) : NULL;
+	
+	if (sdcard_iscapturing() && (cmd == NULL || !(cmd->flags & GC_SD_CONTROL))) {
+		sdcard_writeline(parserState.parsePos);
+		return SEND_REPLY;
+	}
+	
+	if (cmd == NULL)
+	{
+		sendReply("Unknown %c%d\n\r",letter,number);
+		return NO_REPLY;
+	}
+	
+	commandHits[cmd - gcode_commands]++;
+	gcode_tokenize(cmd->params);
+	return cmd->handler();
+}
+
+
+//a command is waiting or lines are queued behind one, new lines have to be queued too
+static int gcode_is_busy()
+{
+	return parserState.wait.poll != NULL || parserState.queueCount > 0;
+}
+
+//with CONCURRENT_HEATUP, wait for a bed heat-up left pending by M190 before the first line
+//that is not part of the heat-up sequence. the line itself runs when the wait is done.
+static void gcode_check_heatup(uint8_t binary,const char* line)
+{
+#ifdef CONCURRENT_HEATUP
+	const GCodeCommand* cmd = NULL;
+	
+	if (!parserState.heatup.bedPending || parserState.wait.poll != NULL || sdcard_iscapturing())
+		return;
+	
+	if (!binary && line[0] == 'T')
+		cmd = gcode_find_command('T',0);
+	else if (!binary)
+		cmd = gcode_find_command(line[0],strtol(line+1,NULL,10));
+	
+	if (cmd && (cmd->flags & GC_HEATUP))
+		return;
+	
+	parserState.wait.lastReport = timestamp;
+	parserState.wait.deferred = true;
+	parserState.wait.poll = gcode_wait_bed;
+#endif
+}
+
+static void gcode_queue_line(uint8_t binary,const void* data,uint32_t len)
+{
+	QueuedLine* entry = &parserState.lineQueue[(parserState.queueHead + parserState.queueCount) % LINE_QUEUE_SIZE];
+	
+	entry->binary = binary;
+	memcpy(entry->data,data,len);
+	parserState.queueCount++;
+}
+
+static void gcode_acknowledge()
+{
+	if (sdcard_isreplaying() == false)
+		sendReply("ok\r\n");
+	
+	previous_millis_cmd = timestamp;
+}
+
+//process a checked line
+static void gcode_execute_line(char* line)
+{
+	parserState.paramsValid = 0;
+	parserState.parsePos = line;
+	
+//	DEBUG("gcode line: '%s'\n\r",parserState.parsePos);
+	if (gcode_process_command() == SEND_REPLY)
+		gcode_acknowledge();
+}
 
 //full line has been received, process it for line number, checksum, etc. before processing the actual command
 static void gcode_line_received()
 {
+	parserState.paramsValid = 0;
 	if (parserState.commandLen)
 	{
 		if (parserState.commandBuffer[0] == 'N')
@@ -1120,37 +1993,235 @@ static void gcode_line_received()
 			return;
 		}
 
-		parserState.parsePos = trim_line(parserState.commandBuffer);
+		char* line = trim_line(parserState.commandBuffer);
+		
+		gcode_check_heatup(false,line);
+		if (gcode_is_busy())
+			gcode_queue_line(false,line,strlen(line)+1);
+		else
+			gcode_execute_line(line);
+	}
+	
+}
 
-//		DEBUG("gcode line: '%s'\n\r",parserState.parsePos);
-		if (gcode_process_command() == SEND_REPLY)
-		{
-            if (sdcard_isreplaying() == false)
-                sendReply("ok\r\n");
-            
-			previous_millis_cmd = timestamp;
-		}
+//word-at-a-time helpers for the line scanner
+#define ONES_32 0x01010101UL
+#define HIGHS_32 0x80808080UL
+#define HAS_ZERO_BYTE(v) (((v) - ONES_32) & ~(v) & HIGHS_32)
+#define HAS_BYTE(v,b) HAS_ZERO_BYTE((v) ^ (ONES_32 * (uint8_t)(b)))
+
+static inline int is_special_char(uint8_t chr,int comment_mode)
+{
+	return chr == '\n' || chr == '\r' || chr == '\0' ||
+		(!comment_mode && (chr == ';' || chr == '('));
+}
+
+//find the first line terminator ('\n', '\r', '\0') in [pos,end) or, outside of comments,
+//the first comment start (';', '('). returns end if none is found.
+static const uint8_t* find_special_char(const uint8_t* pos,const uint8_t* end,int comment_mode)
+{
+	while (pos < end && ((uint32_t)pos & 3))
+	{
+		if (is_special_char(*pos,comment_mode))
+			return pos;
+		pos++;
+	}
+	
+	while (pos + 4 <= end)
+	{
+		uint32_t v = *(const uint32_t*)pos;
+		if (HAS_BYTE(v,'\n') || HAS_BYTE(v,'\r') || HAS_ZERO_BYTE(v) ||
+			(!comment_mode && (HAS_BYTE(v,';') || HAS_BYTE(v,'('))))
+			break;
+		pos += 4;
 	}
 	
+	while (pos < end)
+	{
+		if (is_special_char(*pos,comment_mode))
+			return pos;
+		pos++;
+	}
+	return end;
 }
 
-void gcode_init(ReplyFunction replyFunc)
+static int16_t get_le16(const uint8_t* ptr)
 {
-	ringbuffer_init(&uartBuffer);
-	memset(&parserState,0,sizeof(ParserState));
-	parserState.replyFunc = replyFunc;
+	return (int16_t)(ptr[0] | (ptr[1] << 8));
+}
+
+static int32_t get_le32(const uint8_t* ptr)
+{
+	return (int32_t)(ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24));
+}
+
+//total length of a binary frame of the given type, 0 if unknown
+static uint8_t gcode_binary_length(uint8_t type)
+{
+	switch(type)
+	{
+		case BIN_MOVE_DELTA:
+			return BIN_HEADER_LEN + 4*2 + 2 + 2;
+		case BIN_MOVE_ABS:
+			return BIN_HEADER_LEN + 4*4 + 2 + 2;
+	}
+	return 0;
+}
+
+//queue the move of a checked binary frame
+static void gcode_binary_move(const uint8_t* frame)
+{
+	const uint8_t* payload = frame + BIN_HEADER_LEN;
+	uint8_t len = gcode_binary_length(frame[1]);
+	int i;
 	
-	samserial_setcallback(gcode_datareceived);
+	//continue from where the last ascii command left the position
+	if (memcmp(parserState.binLastPosition,current_position,sizeof(parserState.binLastPosition)) != 0)
+	{
+		for (i=0;i<NUM_AXIS;i++)
+			parserState.binPosition[i] = (int32_t)(current_position[i]*1000.0f + (current_position[i] < 0 ? -0.5f : 0.5f));
+	}
+	
+	for (i=0;i<NUM_AXIS;i++)
+	{
+		if (frame[1] == BIN_MOVE_DELTA)
+			parserState.binPosition[i] += get_le16(payload+2*i);
+		else
+			parserState.binPosition[i] = get_le32(payload+4*i);
+		destination[i] = parserState.binPosition[i] / 1000.0f;
+	}
+	
+	uint16_t f = (uint16_t)get_le16(frame+len-4);
+	if (f > 0)
+		feedrate = f;
+	
+	prepare_move();
+	memcpy(parserState.binLastPosition,current_position,sizeof(parserState.binLastPosition));
+	
+	sendReply("ok\r\n");
+	previous_millis_cmd = timestamp;
 }
 
-void gcode_update()
+//a complete binary frame has been received, check it and queue the move
+static void gcode_binary_frame()
+{
+	const uint8_t* frame = parserState.binFrame;
+	uint8_t len = parserState.binLen;
+	
+	if ((uint16_t)get_le16(frame+len-2) != crc16(frame+1,len-3))
+	{
+		sendReply("rs %u incorrect checksum\r\n",parserState.binSeq);
+		parserState.bin_drop = true;
+		return;
+	}
+	if (frame[2] != parserState.binSeq)
+	{
+		sendReply("rs %u sequence number incorrect\r\n",parserState.binSeq);
+		parserState.bin_drop = true;
+		return;
+	}
+	parserState.binSeq++;
+	
+	if (sdcard_iscapturing())
+	{
+		sendReply("binary moves can not be written to sd card\r\n");
+		return;
+	}
+	
+	gcode_check_heatup(true,(const char*)frame);
+	if (gcode_is_busy())
+		gcode_queue_line(true,frame,len);
+	else
+		gcode_binary_move(frame);
+}
+
+//collect the bytes of a binary frame, returns the number of characters consumed
+static uint32_t gcode_binary_feed(const uint8_t* data,uint32_t len,int* pLineDone)
+{
+	uint32_t count = 0;
+	uint8_t frameLen = 0;
+	
+	while (count < len)
+	{
+		parserState.binFrame[parserState.binLen++] = data[count++];
+		
+		if (parserState.binLen < 2)
+			continue;
+		
+		frameLen = gcode_binary_length(parserState.binFrame[1]);
+		if (frameLen == 0)
+		{
+			sendReply("rs %u unknown frame type\r\n",parserState.binSeq);
+			parserState.binLen = 0;
+			parserState.bin_drop = true;
+			break;
+		}
+		if (parserState.binLen == frameLen)
+		{
+			gcode_binary_frame();
+			parserState.binLen = 0;
+			*pLineDone = 1;
+			break;
+		}
+	}
+	return count;
+}
+
+//feed a block of received characters into the command buffer, processing at most one line.
+//returns the number of characters consumed, *pLineDone is set when a line has been processed.
+static uint32_t gcode_feed(const uint8_t* data,uint32_t len,int* pLineDone)
 {
-	uint8_t chr='\0';
-	while (ringbuffer_numAvailable(&uartBuffer) > 0)
+	const uint8_t* pos = data;
+	const uint8_t* end = data + len;
+	
+	*pLineDone = 0;
+	if (len)
+		parserState.cr_pending = false;
+	
+	//after a bad frame the stream may be out of step (unknown type, lost byte): input is
+	//dropped up to the next frame start or the end of a line, it is not g-code
+	if (parserState.bin_drop)
+	{
+		while (pos < end && *pos != BIN_SYNC && *pos != '\n')
+			pos++;
+		if (pos == end)
+			return len;
+		parserState.bin_drop = false;
+		if (*pos == '\n')
+			pos++;
+		return pos - data;
+	}
+	
+	//binary frames start at a line boundary with a character never used in g-code
+	if (len && (parserState.binLen || (parserState.binary_mode && parserState.commandLen == 0 &&
+		!parserState.comment_mode && *data == BIN_SYNC)))
+	{
+		return gcode_binary_feed(data,len,pLineDone);
+	}
+	
+	while (pos < end)
 	{
-		chr = ringbuffer_get(&uartBuffer);
+		const uint8_t* special = find_special_char(pos,end,parserState.comment_mode);
 		
-		switch(chr)
+		if (!parserState.comment_mode && special > pos)
+		{
+			uint32_t count = special - pos;
+			uint32_t room = BUFFER_SIZE - 1 - parserState.commandLen;
+			
+			if (count > room)
+			{
+				printf("error: command buffer full!\n\r");
+				count = room;
+			}
+			memcpy(&parserState.commandBuffer[parserState.commandLen],pos,count);
+			parserState.commandLen += count;
+		}
+		
+		pos = special;
+		if (pos == end)
+			break;
+		
+		switch(*pos++)
 		{
 			case '\0':
 				break;
@@ -1160,73 +2231,116 @@ void gcode_update()
 				break;
 			case '\n':
 			case '\r':
+				parserState.cr_pending = (pos[-1] == '\r');
 				parserState.commandBuffer[parserState.commandLen] = 0;
 				parserState.parsePos = parserState.commandBuffer;
 				gcode_line_received();
 				parserState.comment_mode = false;
 				parserState.commandLen = 0;
-				
-				break;
-			default:
-				if (parserState.commandLen >= BUFFER_SIZE)
-				{
-					printf("error: command buffer full!\n\r");
-				}
-				else
-				{
-					if (!parserState.comment_mode)
-						parserState.commandBuffer[parserState.commandLen++] = chr;
-				}
-				break;
+				*pLineDone = 1;
+				return pos - data;
 		}
+	}
+	return pos - data;
+}
+
+//finish a waiting command once its condition is met, then run the lines queued behind it
+static void gcode_run_pending()
+{
+	if (parserState.wait.poll)
+	{
+		if (!parserState.wait.poll())
+			return;
 		
+		parserState.wait.poll = NULL;
+		if (!parserState.wait.deferred)
+			gcode_acknowledge();
 	}
-	if(parserState.commandLen == 0 && sdcard_isreplaying() && !sdcard_isreplaypaused()){
-		int newline=0;
-        unsigned char nchar=0;
-		while(!newline){
-			int x=sdcard_getchar(&nchar);
-			if(!x){
-				sendReply("Done printing file\n\r");
+	
+	while (parserState.wait.poll == NULL && parserState.queueCount)
+	{
+		QueuedLine* entry = &parserState.lineQueue[parserState.queueHead];
+		
+		gcode_check_heatup(entry->binary,entry->data);
+		if (parserState.wait.poll)
+			break;
+		
+		if (entry->binary)
+			gcode_binary_move((const uint8_t*)entry->data);
+		else
+			gcode_execute_line(entry->data);
+		
+		parserState.queueHead = (parserState.queueHead + 1) % LINE_QUEUE_SIZE;
+		parserState.queueCount--;
+	}
+}
+
+void gcode_init(ReplyFunction replyFunc,ReplyFunction reportFunc)
+{
+	ringbuffer_init(&uartBuffer);
+	memset(&parserState,0,sizeof(ParserState));
+	parserState.replyFunc = replyFunc;
+	parserState.reportFunc = reportFunc;
+	
+	samserial_setcallback(gcode_datareceived);
+}
+
+void gcode_update()
+{
+	const uint8_t* pData;
+	uint32_t avail;
+	int lineDone;
+	
+	gcode_run_pending();
+	
+	//consume the receive ring in contiguous spans, releasing each line as soon as it is processed.
+	//while a command waits, lines are checked and queued until the queue is full.
+	while (parserState.queueCount < LINE_QUEUE_SIZE && !sdcard_isuploading() && (avail = ringbuffer_peek(&uartBuffer,&pData)) > 0)
+	{
+		ringbuffer_skip(&uartBuffer,gcode_feed(pData,avail,&lineDone));
+	}
+	
+	//raw upload (M560): the received data goes to the sd card. a CRLF host still has
+	//the '\n' of the M560 line on its way, it must not end up in the first frame.
+	while (sdcard_isuploading() && (avail = ringbuffer_peek(&uartBuffer,&pData)) > 0)
+	{
+		if (parserState.cr_pending)
+		{
+			parserState.cr_pending = false;
+			if (*pData == '\n')
+			{
+				ringbuffer_skip(&uartBuffer,1);
+				continue;
+			}
+		}
+		ringbuffer_skip(&uartBuffer,sdcard_uploadfeed(pData,avail));
+	}
+	
+	if(parserState.commandLen == 0 && !gcode_is_busy() && sdcard_isreplaying() && !sdcard_isreplaypaused()){
+		//one line per pass, fed in spans straight from the read buffers. the next pass
+		//takes it if the chunk is still being read, unless half the line is in already.
+		int count;
+		lineDone=0;
+		while(!lineDone){
+			count = sdcard_peek(&pData,parserState.commandLen != 0);
+			if(count == -2){
+				sendReply("error: file read failed\n\r");
 				sdcard_replaystop();
-				newline=1;
 				break;
 			}
-//			printf("%c\n\r",nchar);
-		switch(nchar)
-		{
-			case '\0':
-				newline=1;
-				break;
-			case ';':
-			case '(':
-				parserState.comment_mode = true;
-				break;
-			case '\n':
-			case '\r':
-				parserState.commandBuffer[parserState.commandLen] = 0;
-				parserState.parsePos = parserState.commandBuffer;
-				gcode_line_received();
-				parserState.comment_mode = false;
-				parserState.commandLen = 0;
-				newline=1;
-				break;
-			default:
-				if (parserState.commandLen >= BUFFER_SIZE)
-				{
-					printf("error: command buffer full!\n\r");
-				}
-				else
-				{
-					if (!parserState.comment_mode)
-						parserState.commandBuffer[parserState.commandLen++] = nchar;
-				}
+			if(count < 0){
+				sendReply("Done printing file\n\r");
+				sdcard_replaystop();
 				break;
-		}
-	
+			}
+			if(count == 0){
+				if(parserState.commandLen == 0)
+					break;
+				scheduler_run();
+				continue;
+			}
+			sdcard_skip(gcode_feed(pData,count,&lineDone));
 		}
 	}
 	
 }
-
-
@@ -21,7 +21,7 @@
 
 typedef void (*ReplyFunction)(const char* format,...);
 
-void gcode_init(ReplyFunction replyFunc);
+void gcode_init(ReplyFunction replyFunc,ReplyFunction reportFunc);
 void gcode_update();
 
 int32_t get_int(char chr);
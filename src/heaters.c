@@ -30,37 +30,67 @@
 #include "heaters.h"
 #include "thermistortables.h"
 #include "serial.h"
+#include "scheduler.h"
+#include "planner.h"
 
 #define HEATER_BED			0
 #define HEATER_HOTEND_1		1
 #define HEATER_HOTEND_2		2
 
-const Pin BEDHEAT={1 <<  20, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin HOTEND1={1 <<  21, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin HOTEND2={1 <<  23, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin AUX1={1 <<  25, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin AUX2={1 <<  24, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-
-/// LED pin definition.
-const Pin PIN_LED1 = {1 << 22, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED2 = {1 << 29, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED3 = {1 << 28, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED4 = {1 << 2 , AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED5 = {1 << 1 , AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED6 = {1 << 0 , AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED7 = {1 << 26, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED8 = {1 << 20, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT};
-const Pin PIN_LED9 = {1 << 0 , AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT};
+/// FET pin definition: BED, HOTEND1, HOTEND2, AUX1, AUX2.
+/// The bed FET (PA20) is driven by PWM channel 3 (PWMH3, peripheral B),
+/// the other FETs have no PWM or timer output and use the soft PWM.
+static const Pin FETPINS[] = {
+#ifdef BED_SSR_MODULATION
+	{1 <<  20, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP},
+#else
+	{1 <<  20, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_PERIPH_B, PIO_DEFAULT},
+#endif
+	{1 <<  21, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP},
+	{1 <<  23, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP},
+	{1 <<  25, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP},
+	{1 <<  24, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP}
+};
+#define NUM_FETS 5
+
+/// PIOA masks of the FETs, indexed like FETPINS
+static const unsigned int fet_mask[NUM_FETS] = {1 << 20, 1 << 21, 1 << 23, 1 << 25, 1 << 24};
+
+/// LED pin definition, LED1..LED9.
+static const Pin LEDPINS[] = {
+	{1 << 22, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 29, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 28, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 2 , AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 1 , AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 0 , AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 26, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 20, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT},
+	{1 << 0 , AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_DEFAULT}
+};
+#define NUM_LEDS 9
+
+/// Bed PWM: MCK/1024 and 255 steps, about 370 Hz
+#define BED_PWM_CHANNEL	3
+#define BED_PWM_PERIOD	255
+
+#ifdef BED_SSR_MODULATION
+/// Bed duty for the slow modulation in heater_soft_pwm()
+static volatile unsigned char bed_ssr_duty = 0;
+#endif
 
 
 extern const Pin time_check2;
 extern volatile unsigned long timestamp;
 
-unsigned char autotune_active = false;
+//heater under autotune, not touched by manage_heaters()
+static heater_struct *autotune_heater = NULL;
+//heater under evaluation, held at its setpoints by the PID
+static heater_struct *eval_heater = NULL;
 
 //Global struct for Heatercontrol
 heater_struct heaters[2];	//MAX_EXTRUDERS ?
-heater_bed_struct bed_heater;
+heater_struct bed_heater;
 
 //-----------------------------------------------------
 /// SOFT Pwm for Heater 1 & 2 and Ext Pwm 1 & 2 like Fan
@@ -75,39 +105,57 @@ volatile unsigned char g_pwm_aktiv[4] = {0,0,0,0};
 //-------------------------
 void heaters_setup()
 {
-	Pin FETPINS[]={BEDHEAT,HOTEND1,HOTEND2,AUX1,AUX2};
-	Pin LEDPINS[]={PIN_LED1,PIN_LED2,PIN_LED3,PIN_LED4,PIN_LED5,PIN_LED6,PIN_LED7,PIN_LED8,PIN_LED9};
-
-	PIO_Configure(FETPINS,5);
-	PIO_Configure(LEDPINS,9);
-
 	unsigned short i;
 	
-	for(i=0;i<5;++i)
+#ifndef BED_SSR_MODULATION
+	//-------- PWM channel for the bed, starts with 0% duty before the pin is switched to it --------
+	AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_PWMC;
+	AT91C_BASE_PWMC->PWMC_DIS = 1 << BED_PWM_CHANNEL;
+	AT91C_BASE_PWMC_CH3->PWMC_CMR = AT91C_PWMC_CPRE_MCK_DIV_1024;
+	AT91C_BASE_PWMC_CH3->PWMC_CPRDR = BED_PWM_PERIOD;
+	AT91C_BASE_PWMC_CH3->PWMC_CDTYR = 0;
+	AT91C_BASE_PWMC->PWMC_ENA = 1 << BED_PWM_CHANNEL;
+#endif
+	
+	PIO_Configure(FETPINS,NUM_FETS);
+	PIO_Configure(LEDPINS,NUM_LEDS);
+	
+	for(i=0;i<NUM_FETS;++i)
 		PIO_Clear(&(FETPINS[i]));
 
-	for(i=0;i<9;++i)
+	for(i=0;i<NUM_LEDS;++i)
 		PIO_Clear(&(LEDPINS[i]));
-		
 	
 	init_heaters_values();	
 
 }
 
+//-------------------------
+// Bed duty cycle 0..255, the new value is taken at the start of the next period
+//-------------------------
+static void bed_pwm_set(unsigned char duty)
+{
+#ifdef BED_SSR_MODULATION
+	bed_ssr_duty = duty;
+#else
+	AT91C_BASE_PWMC_CH3->PWMC_CDTYUPDR = duty;
+#endif
+}
+
 //-------------------------
 // IO Function for FET's
 //-------------------------
 void heater_switch(unsigned char heater, unsigned char en)
 {
-	Pin FETPINS[]={BEDHEAT,HOTEND1,HOTEND2,AUX1,AUX2};
-
-	if(heater<0||heater>5)
+	if(heater>=NUM_FETS)
 		return;
 	
-	if(en)
-		PIO_Set(&(FETPINS[heater]));
+	if(heater == HEATER_BED)
+		bed_pwm_set(en ? BED_PWM_PERIOD : 0);
+	else if(en)
+		AT91C_BASE_PIOA->PIO_SODR = fet_mask[heater];
 	else
-		PIO_Clear(&(FETPINS[heater]));
+		AT91C_BASE_PIOA->PIO_CODR = fet_mask[heater];
 }
 
 //-------------------------
@@ -115,9 +163,7 @@ void heater_switch(unsigned char heater, unsigned char en)
 //-------------------------
 void LED_switch(unsigned char led, unsigned char en)
 {
-	Pin LEDPINS[]={PIN_LED1,PIN_LED2,PIN_LED3,PIN_LED4,PIN_LED5,PIN_LED6,PIN_LED7,PIN_LED8,PIN_LED9};
-
-	if(led<0||led>9)
+	if(led>=NUM_LEDS)
 		return;
 	
 	if(en)
@@ -165,44 +211,42 @@ signed short temp2analog_thermistor_table(signed short celsius, const short tabl
 
 
 //--------------------------------------------
-// Convert mV to �C with Compute function
+// Convert mV to 1/16 C with Compute function
 //---------------------------------------------
-signed short analog2temp_thermistor_compute(signed short raw, const float beta, const float rs, const float r_inf)
+static signed short analog2temp16_thermistor_compute(signed short raw, const float beta, const float rs, const float r_inf)
 {
 	//Support to compute temperature  from themistor Beta
 	//Thanks to bilsef
-	signed short celsius = 0; 
+	float celsius; 
 	
-	if ((raw < 0) || (raw >= ADC_VREF)) 
+	if ((raw <= 0) || (raw >= ADC_VREF)) 
 		return (0);    // return if value is out of range 
 
 	float r = rs/((ADC_VREF/(float)(raw))-1); 
 
-	celsius = 0.5 + ABS_ZERO + beta/log( r/r_inf ); 
+	celsius = ABS_ZERO + beta/log( r/r_inf ); 
 
 	if (celsius < 0) 
-		celsius = 0; 
+		return 0; 
 
-	return celsius; 
-
-	
+	return (signed short)(0.5 + celsius*16); 
 }
 
 //--------------------------------------------------
-// Convert Analog to temperatur with Tablefunction
+// Convert Analog to 1/16 C with Tablefunction
 //--------------------------------------------------
-signed short analog2temp_thermistor_table(signed short raw,const short table[][2], signed short numtemps)
+static signed short analog2temp16_thermistor_table(signed short raw,const short table[][2], signed short numtemps)
 {
-	signed short celsius = 0;
+	signed short celsius16 = 0;
 	unsigned char i;
 
 	for (i=1; i<numtemps; i++)
 	{
 		if (table[i][0] > raw)
 		{
-			celsius  = table[i-1][1] + 
+			celsius16  = table[i-1][1]*16 + 
 			(raw - table[i-1][0]) * 
-			(table[i][1] - table[i-1][1]) /
+			(table[i][1] - table[i-1][1]) * 16 /
 			(table[i][0] - table[i-1][0]);
 
 			break;
@@ -210,52 +254,52 @@ signed short analog2temp_thermistor_table(signed short raw,const short table[][2
 	}
 
 	// Overflow: Set to last value in the table
-	if (i == numtemps) celsius = table[i-1][1];
+	if (i == numtemps) celsius16 = table[i-1][1]*16;
 
-	return celsius;
+	return celsius16;
 }
 
 
 //--------------------------------------------------
-// Convert fron Analog to Temperatur , Sensortype can select online
+// Convert fron Analog to 1/16 C, only used to build the lookup tables
 //--------------------------------------------------
-signed short analog2temp_convert(signed short raw, unsigned char sensortype)
+static signed short analog2temp16_convert(signed short raw, unsigned char sensortype)
 {
 	signed short temperature = 0;
 
 	switch(sensortype)
 	{
 		case THERMISTORTYP_TABLE_1:
-			temperature = analog2temp_thermistor_table(raw,temptable_1,NUMTEMPS_1);
+			temperature = analog2temp16_thermistor_table(raw,temptable_1,NUMTEMPS_1);
 		break;
 		
 		case THERMISTORTYP_TABLE_2:
-			temperature = analog2temp_thermistor_table(raw,temptable_2,NUMTEMPS_2);
+			temperature = analog2temp16_thermistor_table(raw,temptable_2,NUMTEMPS_2);
 		break;
 		
 		case THERMISTORTYP_TABLE_3:
-			temperature = analog2temp_thermistor_table(raw,temptable_3,NUMTEMPS_3);
+			temperature = analog2temp16_thermistor_table(raw,temptable_3,NUMTEMPS_3);
 		break;
 		
 		case THERMISTORTYP_TABLE_4:
-			temperature = analog2temp_thermistor_table(raw,temptable_4,NUMTEMPS_4);
+			temperature = analog2temp16_thermistor_table(raw,temptable_4,NUMTEMPS_4);
 		break;
 		
 		case THERMISTORTYP_TABLE_5:
-			temperature = analog2temp_thermistor_table(raw,temptable_5,NUMTEMPS_5);
+			temperature = analog2temp16_thermistor_table(raw,temptable_5,NUMTEMPS_5);
 		break;
 		
 		case THERMISTORTYP_TABLE_6:
-			temperature = analog2temp_thermistor_table(raw,temptable_6,NUMTEMPS_6);
+			temperature = analog2temp16_thermistor_table(raw,temptable_6,NUMTEMPS_6);
 		break;
 		
 		case THERMISTORTYP_TABLE_7:
-			temperature = analog2temp_thermistor_table(raw,temptable_7,NUMTEMPS_7);
+			temperature = analog2temp16_thermistor_table(raw,temptable_7,NUMTEMPS_7);
 		break;
 		
 		//Calclate Temperatur with formular
 		case THERMISTORTYP_COMPUTE_11:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_11, E_RS, E_R_INF_11);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_11, E_RS, E_R_INF_11);
 		break;
 
 		case THERMISTORTYP_COMPUTE_12:
@@ -263,28 +307,28 @@ signed short analog2temp_convert(signed short raw, unsigned char sensortype)
 		break;
 
 		case THERMISTORTYP_COMPUTE_13:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_13, E_RS, E_R_INF_13);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_13, E_RS, E_R_INF_13);
 		break;
 
 		case THERMISTORTYP_COMPUTE_14:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_14, E_RS, E_R_INF_14);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_14, E_RS, E_R_INF_14);
 		break;
 
 		case THERMISTORTYP_COMPUTE_15:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_15, E_RS, E_R_INF_15);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_15, E_RS, E_R_INF_15);
 		break;
 
 		case THERMISTORTYP_COMPUTE_16:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_16, E_RS, E_R_INF_16);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_16, E_RS, E_R_INF_16);
 		break;
 
 		case THERMISTORTYP_COMPUTE_17:
-			temperature = analog2temp_thermistor_compute(raw, E_BETA_17, E_RS, E_R_INF_17);
+			temperature = analog2temp16_thermistor_compute(raw, E_BETA_17, E_RS, E_R_INF_17);
 		break;
 
 	
 		case AD595_TYP_50:
-			temperature = (signed short)((int)raw * 500 / ADC_VREF);
+			temperature = (signed short)((int)raw * 500 * 16 / ADC_VREF);
 		break;
 	
 		default:
@@ -297,6 +341,49 @@ signed short analog2temp_convert(signed short raw, unsigned char sensortype)
 }
 
 
+//--------------------------------------------------
+// Lookup tables, one per sensor, evenly spaced in mV.
+// Built at boot and when M530 changes the sensor type, so the
+// control loop only needs an index and one interpolation step.
+//--------------------------------------------------
+#define TEMP_TABLE_SHIFT	4		// 16 mV per entry
+#define TEMP_TABLE_SIZE		((ADC_VREF >> TEMP_TABLE_SHIFT) + 2)
+
+static signed short temp_table[TEMP_SENSORS][TEMP_TABLE_SIZE];	// 1/16 C
+
+void temp_table_build(unsigned char sensor, unsigned char sensortype)
+{
+	unsigned short i;
+
+	if(sensor >= TEMP_SENSORS)
+		return;
+
+	for(i=0;i<TEMP_TABLE_SIZE;i++)
+		temp_table[sensor][i] = analog2temp16_convert(i << TEMP_TABLE_SHIFT,sensortype);
+}
+
+signed short temp_table_read16(unsigned char sensor, unsigned int raw)
+{
+	const signed short *entry;
+	signed int frac;
+
+	if(raw > ADC_VREF)
+		raw = ADC_VREF;
+
+	entry = &temp_table[sensor][raw >> TEMP_TABLE_SHIFT];
+	frac = raw & ((1 << TEMP_TABLE_SHIFT) - 1);
+
+	// interpolate in 1/16 C
+	return entry[0] + (((entry[1] - entry[0]) * frac) >> TEMP_TABLE_SHIFT);
+}
+
+signed short temp_table_read(unsigned char sensor, unsigned int raw)
+{
+	// round to C
+	return (temp_table_read16(sensor,raw) + 8) >> 4;
+}
+
+
 //-------------------------
 // Init heater Values
 //-------------------------
@@ -311,11 +398,13 @@ void init_heaters_values(void)
 	heaters[0].PID_Kp = pa.heater_pTerm[0];
 	heaters[0].PID_I = pa.heater_iTerm[0];
 	heaters[0].PID_Kd = pa.heater_dTerm[0];
+	heaters[0].FF_gain = pa.heater_ff_gain[0];
 	heaters[0].temp_iState = 0;
-	heaters[0].prev_temp = 0;
-	heaters[0].temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (signed short)heaters[0].PID_I;
-	heaters[0].temp_iState_min = heaters[0].temp_iState_max * (-1);
+	heaters[0].prev_millis = 0;
+	heater_PID_limits(&heaters[0]);
+	heaters[0].sensor = 0;
 	heaters[0].thermistor_type = pa.heater_thermistor_type[0];
+	temp_table_build(0,heaters[0].thermistor_type);
 	heaters[0].slope = pa.heater_slope[0];
 	heaters[0].intercept = pa.heater_intercept[0];
 	heaters[0].max_pwm = pa.heater_max_pwm[0];
@@ -328,77 +417,111 @@ void init_heaters_values(void)
 	heaters[1].PID_Kp = pa.heater_pTerm[1];
 	heaters[1].PID_I = pa.heater_iTerm[1];
 	heaters[1].PID_Kd = pa.heater_dTerm[1];
+	heaters[1].FF_gain = pa.heater_ff_gain[1];
 	heaters[1].temp_iState = 0;
-	heaters[1].prev_temp = 0;
-	heaters[1].temp_iState_max = (256L * PID_INTEGRAL_DRIVE_MAX) / (signed short)heaters[1].PID_I;
-	heaters[1].temp_iState_min = heaters[1].temp_iState_max * (-1);
+	heaters[1].prev_millis = 0;
+	heater_PID_limits(&heaters[1]);
+	heaters[1].sensor = 1;
 	heaters[1].thermistor_type = pa.heater_thermistor_type[1];
+	temp_table_build(1,heaters[1].thermistor_type);
 	heaters[1].slope = pa.heater_slope[1];
 	heaters[1].intercept = pa.heater_intercept[1];
 	heaters[1].max_pwm = pa.heater_max_pwm[1];
 	
+	bed_heater.io_adr = HEATER_BED;
+	bed_heater.ad_cannel = 5;
+	bed_heater.pwm = 0;
+	bed_heater.soft_pwm_aktiv = 0;
 	bed_heater.target_temp = 0;
 	bed_heater.akt_temp = 0;
+	bed_heater.PID_Kp = pa.bed_pTerm;
+	bed_heater.PID_I = pa.bed_iTerm;
+	bed_heater.PID_Kd = pa.bed_dTerm;
+	bed_heater.FF_gain = 0;
+	bed_heater.temp_iState = 0;
+	bed_heater.prev_millis = 0;
+	heater_PID_limits(&bed_heater);
+	bed_heater.sensor = TEMP_SENSOR_BED;
 	bed_heater.thermistor_type = pa.bed_thermistor_type;
+	temp_table_build(TEMP_SENSOR_BED,bed_heater.thermistor_type);
+	bed_heater.slope = 0;
+	bed_heater.intercept = 0;
+	bed_heater.max_pwm = BED_MAX_PWM;
 	
-	
+}
+
+//-------------------------
+// Integral limit: the I term alone can drive at most PID_INTEGRAL_DRIVE_MAX
+//-------------------------
+void heater_PID_limits(heater_struct *heater)
+{
+	if(heater->PID_I > 0)
+		heater->temp_iState_max = (256L * 16 * 1000 * PID_INTEGRAL_DRIVE_MAX) / heater->PID_I;
+	else
+		heater->temp_iState_max = 0;
+	heater->temp_iState_min = heater->temp_iState_max * (-1);
+	heater->temp_iState = constrain(heater->temp_iState, heater->temp_iState_min, heater->temp_iState_max);
 }
 
 
 
 //--------------------------------------------------
-// Soft PWM, runs every 100 us
-// need 2,12 us  + 0,3 us per PWM channel
+// Sigma-delta modulation for the hotends and fans, called every 1 ms by SysTick.
+// Each channel adds its duty to an accumulator and is on for the ticks where the
+// accumulator overflows, so the on-time is spread evenly at full 8-bit resolution.
+// All channels are on PIOA, the outputs are collected in masks and written once.
 //--------------------------------------------------
-volatile unsigned char g_TC1_pwm_cnt = 0;
-volatile unsigned char pwm_io_is_off[4] = {0,0,0,0};
-void TC1_IrqHandler(void)
-{
+static unsigned short pwm_accu[4] = {0,0,0,0};
+#ifdef BED_SSR_MODULATION
+static unsigned short bed_accu = 0;
+static unsigned char bed_tick = 0;
+#endif
 
-	volatile unsigned int dummy;
-	unsigned char cnt_pwm_ch = 0;
-	
-    // Clear status bit to acknowledge interrupt !!
-	// Dont forget --> other interupts are blocked until the bit is cleared
-    dummy = AT91C_BASE_TC1->TC_SR;
-	
-	if(dummy & AT91C_TC_CPCS)
-	{
-	}
+void heater_soft_pwm(void)
+{
+	unsigned char cnt_pwm_ch;
+	unsigned int set_mask = 0;
+	unsigned int clear_mask = 0;
 	
 	PIO_Set(&time_check2);
 	
-	g_TC1_pwm_cnt+=2;
-	
 	//Check the 4 PWM channels
 	for(cnt_pwm_ch = 0;cnt_pwm_ch < 4;cnt_pwm_ch++)
 	{
-		if(g_pwm_aktiv[cnt_pwm_ch] == 1)
+		if(g_pwm_aktiv[cnt_pwm_ch] == 1 && g_pwm_io_adr[cnt_pwm_ch] < NUM_FETS)
 		{
-			if(g_TC1_pwm_cnt == 0)
+			unsigned int mask = fet_mask[g_pwm_io_adr[cnt_pwm_ch]];
+			
+			pwm_accu[cnt_pwm_ch] += g_pwm_value[cnt_pwm_ch];
+			if(pwm_accu[cnt_pwm_ch] >= 255)
 			{
-				if(g_pwm_value[cnt_pwm_ch] == 0)
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 0);
-					pwm_io_is_off[cnt_pwm_ch] = 1;
-				}
-				else
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 1);
-					pwm_io_is_off[cnt_pwm_ch] = 0;
-				}
+				pwm_accu[cnt_pwm_ch] -= 255;
+				set_mask |= mask;
 			}
 			else
-			{
-				if((g_TC1_pwm_cnt >= g_pwm_value[cnt_pwm_ch]) && (pwm_io_is_off[cnt_pwm_ch] == 0))
-				{
-					heater_switch(g_pwm_io_adr[cnt_pwm_ch], 0);
-					pwm_io_is_off[cnt_pwm_ch] = 1;
-				}
-			}
+				clear_mask |= mask;
 		}
 	}
 	
+#ifdef BED_SSR_MODULATION
+	//one decision per BED_SSR_MODULATION ms, the SSR switches at the next zero crossing
+	if(++bed_tick >= BED_SSR_MODULATION)
+	{
+		bed_tick = 0;
+		bed_accu += bed_ssr_duty;
+		if(bed_accu >= 255)
+		{
+			bed_accu -= 255;
+			set_mask |= fet_mask[HEATER_BED];
+		}
+		else
+			clear_mask |= fet_mask[HEATER_BED];
+	}
+#endif
+	
+	AT91C_BASE_PIOA->PIO_CODR = clear_mask;
+	AT91C_BASE_PIOA->PIO_SODR = set_mask;
+	
 	PIO_Clear(&time_check2);
 }
 
@@ -407,23 +530,34 @@ void TC1_IrqHandler(void)
 //--------------------------------------------------
 void heater_on_off_control(heater_struct *hotend)
 {
-	hotend->akt_temp = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
+	signed short temp16 = temp_table_read16(hotend->sensor,adc_read(hotend->ad_cannel));
+	
+	hotend->akt_temp16 = temp16;
+	hotend->akt_temp = (temp16 + 8) >> 4;
 	
 	#ifdef MINTEMP
 	if(hotend->akt_temp < MINTEMP)
-	{
 		hotend->target_temp = 0;
+	#endif
+	
+	#ifdef MAXTEMP
+	if(hotend->akt_temp > MAXTEMP)
+		hotend->target_temp = 0;
+	#endif
+	
+	if(hotend->target_temp == 0)
+	{
 		heater_switch(hotend->io_adr, 0);
 		hotend->pwm = 0;
+		return;
 	}
-	#endif
 		
 	if(hotend->akt_temp  > (hotend->target_temp+1))
 	{
 		heater_switch(hotend->io_adr, 0);
 		hotend->pwm = 0;
 	}
-	else if((hotend->akt_temp  < (hotend->target_temp-1)) && (hotend->target_temp > 0))
+	else if(hotend->akt_temp  < (hotend->target_temp-1))
 	{
 		heater_switch(hotend->io_adr, 1);
 		hotend->pwm = 255;
@@ -434,189 +568,191 @@ void heater_on_off_control(heater_struct *hotend)
 
 
 //--------------------------------------------------
-// Tempcontrol with PID for Hotend
+// Tempcontrol with PID for Hotends and Bed
+// Fixed point in 1/16 C, dt is the measured time since the last call.
+// The D term acts on the filtered measurement, so target changes do not
+// kick the output, and the integral is only kept while it does not drive
+// the output further into saturation (anti-windup).
+// feed_forward is added to the output as it is, see heater_feed_forward().
 //--------------------------------------------------
-void heater_PID_control(heater_struct *hotend)
+void heater_PID_control(heater_struct *hotend, signed short feed_forward)
 {
-	signed short error;
-	signed short delta_temp;
-	signed short heater_duty;
+	signed long error16;
+	signed long iState;
+	signed long heater_duty;
+	signed short temp16;
+	unsigned long now = timestamp;
+	unsigned long dt = now - hotend->prev_millis;
   
-	hotend->akt_temp = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
+	temp16 = temp_table_read16(hotend->sensor,adc_read(hotend->ad_cannel));
+	hotend->akt_temp16 = temp16;
+	hotend->akt_temp = (temp16 + 8) >> 4;
   
 	#ifdef MINTEMP
 	if(hotend->akt_temp < MINTEMP)
-	{
 		hotend->target_temp = 0;
-		heater_switch(hotend->io_adr, 0);
-	}
 	#endif
 	
 	#ifdef MAXTEMP
 	if(hotend->akt_temp > MAXTEMP)
-	{
 		hotend->target_temp = 0;
-		heater_switch(hotend->io_adr, 0);
-	}
 	#endif
 
-	error = hotend->target_temp - hotend->akt_temp;
-	//printf("ERR: %d ", error);
-	delta_temp = hotend->akt_temp - hotend->prev_temp;
+	//first call or the loop was stalled: restart the derivative
+	if(hotend->prev_millis == 0 || dt == 0 || dt > PID_MAX_DT)
+	{
+		hotend->prev_temp16 = temp16;
+		hotend->dState = 0;
+		dt = 0;
+	}
+	hotend->prev_millis = now;
 
-	hotend->prev_temp = hotend->akt_temp;
-	hotend->pTerm = (signed short)(((long)hotend->PID_Kp * error) / 256);
-	
-  const signed short H0 = min(((((long)hotend->slope*(long)hotend->target_temp)>>8)+hotend->intercept),hotend->max_pwm);
-	heater_duty = H0 + hotend->pTerm;
+	if(dt > 0)
+	{
+		signed long slope16 = ((signed long)(temp16 - hotend->prev_temp16) * 1000) / (signed long)dt;
 
-	//printf("P: %d ", hotend->pTerm);
+		hotend->dState += (slope16 - hotend->dState) / (1 << PID_D_FILTER);
+		hotend->prev_temp16 = temp16;
+	}
 
-	if(abs(error) < 30)
+	if(hotend->target_temp == 0)
 	{
-		hotend->temp_iState += error;
-		//printf("I1: %d ", hotend->temp_iState);
-		hotend->temp_iState = constrain(hotend->temp_iState, hotend->temp_iState_min, hotend->temp_iState_max);
-		//printf("I2: %d ", hotend->temp_iState);
-		hotend->iTerm = (signed short)(((long)hotend->PID_I * hotend->temp_iState) / 256);
-		heater_duty += hotend->iTerm;
+		hotend->temp_iState = 0;
+		hotend->pTerm = hotend->iTerm = hotend->dTerm = hotend->ffTerm = 0;
+		hotend->pwm = 0;
+		return;
 	}
-	
-	//printf("I: %d ", hotend->iTerm);
 
-	signed short prev_error = abs(hotend->target_temp - hotend->prev_temp);
-	signed short log3 = 1; // discrete logarithm base 3, plus 1
+	error16 = (signed long)hotend->target_temp * 16 - temp16;
 
-	if(prev_error > 81){ prev_error /= 81; log3 += 4; }
-	if(prev_error >  9){ prev_error /=  9; log3 += 2; }
-	if(prev_error >  3){ prev_error /=  3; log3 ++;   }
+	hotend->pTerm = (signed short)constrain(((signed long)hotend->PID_Kp * error16) / (256 * 16), -1000, 1000);
+	hotend->dTerm = (signed short)constrain(-((signed long)hotend->PID_Kd * hotend->dState) / (256 * 16), -1000, 1000);
 
-	hotend->dTerm = (signed short)(((long)hotend->PID_Kd * delta_temp) / (256*log3));
-	
-	//printf("D: %d ", hotend->dTerm);
-	
-	heater_duty += hotend->dTerm;
-	//printf("PWM: %d \r\n", heater_duty);
-	
-	heater_duty = constrain(heater_duty, 0, hotend->max_pwm);
-	
+	const signed short H0 = min(((((long)hotend->slope*(long)hotend->target_temp)>>8)+hotend->intercept),hotend->max_pwm);
+	hotend->ffTerm = feed_forward;
+	heater_duty = H0 + hotend->ffTerm + hotend->pTerm + hotend->dTerm;
 
+	iState = hotend->temp_iState + error16 * (signed long)dt;
+	iState = constrain(iState, hotend->temp_iState_min, hotend->temp_iState_max);
+	hotend->iTerm = (signed short)(((signed long)hotend->PID_I * iState) / (256L * 16 * 1000));
 
-	if(hotend->target_temp == 0)
-		hotend->pwm = 0;
+	if((heater_duty + hotend->iTerm > hotend->max_pwm && error16 > 0) || (heater_duty + hotend->iTerm < 0 && error16 < 0))
+	{
+		//saturated, keep the old integral
+		hotend->iTerm = (signed short)(((signed long)hotend->PID_I * hotend->temp_iState) / (256L * 16 * 1000));
+	}
 	else
-		hotend->pwm = (unsigned char)heater_duty;
+		hotend->temp_iState = iState;
 
+	heater_duty += hotend->iTerm;
+	heater_duty = constrain(heater_duty, 0, hotend->max_pwm);
 
+	hotend->pwm = (unsigned char)heater_duty;
 }
 
 //--------------------------------------------------
-// Simple Heatbed Tempcontrol with ON/OFF switching
+// Extra heater power for the filament the planner is extruding: the E rate
+// of the executing block (and HEATER_FF_LOOKAHEAD blocks after it) in mm/s
+// times the gain, so the hotend does not sag before the PID notices.
 //--------------------------------------------------
-void onoff_control_bed(void)
+static signed short heater_feed_forward(unsigned char extruder)
 {
-	
-	bed_heater.akt_temp = analog2temp_convert(adc_read(5),bed_heater.thermistor_type);
-	
-	#ifdef MINTEMP
-	if(bed_heater.akt_temp < MINTEMP)
-	{
-		bed_heater.target_temp = 0;
-		heater_switch(HEATER_BED, 0);
-		LED_switch(3,0);
-	}
-	#endif
-			
-	if(bed_heater.akt_temp  > bed_heater.target_temp)
-	{
-		heater_switch(HEATER_BED, 0);
-		LED_switch(3,0);
-	}
-	else if((bed_heater.akt_temp  < bed_heater.target_temp) && (bed_heater.target_temp > 0))
-	{
-		heater_switch(HEATER_BED, 1);
-		LED_switch(3,1);
-	}
+	unsigned long e_rate;
+
+	if(heaters[extruder].FF_gain == 0 || pa.axis_steps_per_unit[3] <= 0)
+		return 0;
+
+	e_rate = plan_e_step_rate(extruder, HEATER_FF_LOOKAHEAD);
+
+	return (signed short)min(((float)e_rate * heaters[extruder].FF_gain) / (pa.axis_steps_per_unit[3] * 256), 255);
 }
 
 //--------------------------------------------------
-// Init Timer 1 for Soft PWM (Hotend 1 & 2)
+// Ring of the last HEATER_LOG_SIZE control ticks of all active heaters,
+// dumped with M633. Heaters that are off are not recorded.
 //--------------------------------------------------
-void ConfigureTc_1(void)
+static heater_log_entry heater_log[HEATER_LOG_SIZE];
+static unsigned int heater_log_head = 0;		// next entry to write
+static unsigned int heater_log_used = 0;
+
+static void heater_log_record(heater_struct *heater)
 {
+	heater_log_entry *entry;
 
-	// Enable peripheral clock
-	AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_TC1;
-	
-	// Configure TC for a 10 kHz frequency and trigger on RC compare
-	unsigned int freq=10000; 
+	if(heater->target_temp == 0 && heater->pwm == 0)
+		return;
 
-	TC_Configure(AT91C_BASE_TC1, 3 | AT91C_TC_CPCTRG);
-	//AT91C_BASE_TC1->TC_RB = 3;
-	AT91C_BASE_TC1->TC_RC = (BOARD_MCK / 128) / freq; // timerFreq / desiredFreq
+	entry = &heater_log[heater_log_head];
+	entry->time = timestamp;
+	entry->heater = heater->sensor;
+	entry->pwm = heater->pwm;
+	entry->target_temp = heater->target_temp;
+	entry->akt_temp16 = heater->akt_temp16;
+	entry->pTerm = heater->pTerm;
+	entry->iTerm = heater->iTerm;
+	entry->dTerm = heater->dTerm;
+	entry->ffTerm = heater->ffTerm;
+
+	if(++heater_log_head >= HEATER_LOG_SIZE)
+		heater_log_head = 0;
+	if(heater_log_used < HEATER_LOG_SIZE)
+		heater_log_used++;
+}
 
-	// Configure and enable interrupt on RC compare
-	IRQ_ConfigureIT(AT91C_ID_TC1, 2, TC1_IrqHandler);
-	AT91C_BASE_TC1->TC_IER = AT91C_TC_CPCS;
-	IRQ_EnableIT(AT91C_ID_TC1);
+unsigned int heater_log_count(void)
+{
+	return heater_log_used;
+}
 
-	// Start the counter if LED is enabled.
-	TC_Start(AT91C_BASE_TC1);
+//oldest entry first
+const heater_log_entry* heater_log_get(unsigned int idx)
+{
+	if(idx >= heater_log_used)
+		return NULL;
 
+	return &heater_log[(heater_log_head + HEATER_LOG_SIZE - heater_log_used + idx) % HEATER_LOG_SIZE];
 }
 
+void heater_log_clear(void)
+{
+	heater_log_head = 0;
+	heater_log_used = 0;
+}
 
 //--------------------------------------------------
-// Cycle Function for Tempcontrol
+// Cycle Function for Tempcontrol, all heaters every HEATER_CHECK_INTERVAL
 //--------------------------------------------------
 void manage_heaters(void)
 {
-	static unsigned char bed_timer = 0;
-	static unsigned char hotend_timer = 0;
+	unsigned char i;
 	
-	bed_timer++;
+	PID_autotune_step();
 	
-	if(bed_timer >= 20)
+	for(i = 0; i < MAX_EXTRUDER; i++)
 	{
-		//Call every 2 sec
-		onoff_control_bed();
+		//without soft pwm (M531) the output is a plain switch, see heater_on_off_control()
+		if(autotune_heater != &heaters[i])
+		{
+			if(heaters[i].soft_pwm_aktiv)
+				heater_PID_control(&heaters[i], heater_feed_forward(i));
+			else
+				heater_on_off_control(&heaters[i]);
+		}
+		g_pwm_value[i] = heaters[i].pwm;
+		g_pwm_io_adr[i] = heaters[i].io_adr;
+		g_pwm_aktiv[i] = heaters[i].soft_pwm_aktiv;
 		
-		bed_timer = 0;
+		LED_switch(4 + i, heaters[i].pwm > 0);
+		heater_log_record(&heaters[i]);
 	}
 	
-	if(hotend_timer == 0)
-	{
-		//Call every 500 ms
-		//heater_on_off_control(&heaters[0]);
-    if(!autotune_active)
-		  heater_PID_control(&heaters[0]);
-		g_pwm_value[0] = heaters[0].pwm;
-		g_pwm_io_adr[0] = heaters[0].io_adr;
-		g_pwm_aktiv[0] = heaters[0].soft_pwm_aktiv;
-		
-		if(g_pwm_value[0] > 0)
-			LED_switch(4,1);
-		else
-			LED_switch(4,0);
-			
-		hotend_timer = 1;
-	}
-	else if(hotend_timer == 1)
-	{
-		heater_on_off_control(&heaters[1]);
-    //if(!autotune_active)
-		//  heater_PID_control(&heaters[1]);
-		g_pwm_value[1] = heaters[1].pwm;
-		g_pwm_io_adr[1] = heaters[1].io_adr;
-		g_pwm_aktiv[1] = heaters[1].soft_pwm_aktiv;
-		
-		if(g_pwm_value[1] > 0)
-			LED_switch(5,1);
-		else
-			LED_switch(5,0);
-		
-		hotend_timer = 0;
-	}
+	if(autotune_heater != &bed_heater)
+		heater_PID_control(&bed_heater, 0);
+	bed_pwm_set(bed_heater.pwm);
+	LED_switch(3, bed_heater.pwm > 0);
+	heater_log_record(&bed_heater);
+	
+	Heater_Eval_step();
 }
 
 //-------------------- START PID AUTOTUNE ---------------------------
@@ -624,192 +760,226 @@ void manage_heaters(void)
 // Thanks to Erik van der Zalm for this idea to use it for Marlin
 // Some information see:
 // http://brettbeauregard.com/blog/2012/01/arduino-pid-autotune-library/
+//
+// Runs as a state machine, PID_autotune_step() is called by manage_heaters()
+// every HEATER_CHECK_INTERVAL and the rest of the firmware keeps running.
 //------------------------------------------------------------------
 
-void PID_autotune(heater_struct *hotend, float PIDAT_test_temp)
+#define PIDAT_TIME_FACTOR 256	// I and D gains are per second
+#define PIDAT_SAMPLES ((1000 + HEATER_CHECK_INTERVAL - 1) / HEATER_CHECK_INTERVAL)	// average over 1 s
+
+static struct {
+  unsigned char active;
+  heater_struct *hotend;
+  float test_temp;
+
+  float input;
+  float input_ave;
+  unsigned char count_input;
+
+  float max;
+  float min;
+
+  unsigned char PWM_val;
+  unsigned char cycles;
+  unsigned char heating;
+
+  unsigned long temp_millis;
+  unsigned long t1;
+  unsigned long t2;
+
+  long t_high;
+  long t_low;
+
+  long bias;
+  long d;
+} pidat;
+
+static void PID_autotune_stop(void)
 {
-  float PIDAT_input = (float)hotend->akt_temp;
-  float PIDAT_input_ave = 0;
-  unsigned char PIDAT_count_input = 0;
+  pidat.hotend->target_temp = 0;
+  pidat.hotend->pwm = 0;
+  pidat.active = false;
+  autotune_heater = NULL;
+}
 
-  float PIDAT_max = 0.0;
-  float PIDAT_min = 250.0;
- 
-  unsigned char PIDAT_PWM_val = hotend->max_pwm;
-  
-  unsigned char PIDAT_cycles = 0;
-  unsigned char PIDAT_heating = true;
+void PID_autotune_cancel(void)
+{
+  if(!pidat.active)
+    return;
 
-  unsigned long PIDAT_temp_millis = timestamp;
-  unsigned long PIDAT_t1 = PIDAT_temp_millis;
-  unsigned long PIDAT_t2 = PIDAT_temp_millis;
-  unsigned long PIDAT_T_check_AI_val = PIDAT_temp_millis;
+  PID_autotune_stop();
+  usb_printf("PID Autotune canceled \r\n");
+}
 
-  
-  long PIDAT_t_high = 0;
-  long PIDAT_t_low = 0;
+unsigned char PID_autotune(heater_struct *hotend, float PIDAT_test_temp)
+{
+  if(pidat.active || autotune_heater != NULL || eval_heater != NULL)
+    return false;
+
+  pidat.hotend = hotend;
+  pidat.test_temp = PIDAT_test_temp;
+
+  pidat.input = (float)hotend->akt_temp;
+  pidat.input_ave = 0;
+  pidat.count_input = 0;
+
+  pidat.max = 0.0;
+  pidat.min = PIDAT_test_temp;
+
+  pidat.PWM_val = hotend->max_pwm;
+  pidat.cycles = 0;
+  pidat.heating = true;
+
+  pidat.temp_millis = timestamp;
+  pidat.t1 = pidat.temp_millis;
+  pidat.t2 = pidat.temp_millis;
+
+  pidat.t_high = 0;
+  pidat.t_low = 0;
+
+  pidat.bias = hotend->max_pwm/2;
+  pidat.d = hotend->max_pwm/2;
 
-  long PIDAT_bias = hotend->max_pwm/2;  
-  long PIDAT_d  =  hotend->max_pwm/2;
-  
-  float PIDAT_Ku = 0, PIDAT_Tu = 0;
-  float PIDAT_Kp = 0, PIDAT_Ki = 0, PIDAT_Kd = 0;
-  
-  #define PIDAT_TIME_FACTOR ((HEATER_CHECK_INTERVAL * 256) / 1000)
-  
   usb_printf("PID Autotune start\r\n");
   printf("PID Autotune channel %u\r\n",hotend->ad_cannel);
 
-  autotune_active = true;  // disable PID while tuning
-
-  PIDAT_min = PIDAT_test_temp;
+  autotune_heater = hotend;  // disable PID while tuning
+  pidat.active = true;
 
   hotend->target_temp = (signed short)PIDAT_test_temp;
-  hotend->pwm = (unsigned char)PIDAT_PWM_val;
+  hotend->pwm = pidat.PWM_val;
   
   #ifdef BED_USES_THERMISTOR
     bed_heater.target_temp = 0;
     heater_switch(HEATER_BED, 0);
     LED_switch(3,0);
   #endif
-  
-  for(;;) 
-  {
-     // Average 10 readings
-    if((timestamp - PIDAT_T_check_AI_val) > 100 )
-    {
-      PIDAT_T_check_AI_val = timestamp;
-      
-      PIDAT_input_ave += analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
 
-      PIDAT_count_input++;
-    }
+  return true;
+}
+
+static void PID_autotune_report(const char *name, float Ku, float Tu, float kp_factor, float kd_divider)
+{
+  const char* cmd = (pidat.hotend == &bed_heater) ? "M304" : "M301";
+  float Kp = kp_factor*Ku;
+  float Ki = 2*Kp/Tu;
+  float Kd = Kp*Tu/kd_divider;
+
+  usb_printf(" %s \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n", name, (unsigned int)(Kp*256),(unsigned int)(Ki*PIDAT_TIME_FACTOR),(unsigned int)(Kd*PIDAT_TIME_FACTOR));
+  usb_printf("  Set with %s P%u I%u D%u\r\n", cmd, (unsigned int)(Kp*256),(unsigned int)(Ki*PIDAT_TIME_FACTOR),(unsigned int)(Kd*PIDAT_TIME_FACTOR));
+}
+
+void PID_autotune_step(void)
+{
+  heater_struct *hotend = pidat.hotend;
+
+  if(!pidat.active)
+    return;
+
+  hotend->akt_temp16 = temp_table_read16(hotend->sensor,adc_read(hotend->ad_cannel));
+  hotend->akt_temp = (hotend->akt_temp16 + 8) >> 4;
+
+  // Average over one second
+  pidat.input_ave += hotend->akt_temp16 / 16.0;
+  pidat.count_input++;
     
-    if(PIDAT_count_input >= 10 )
-    {
-      PIDAT_input = (float)PIDAT_input_ave / (float)PIDAT_count_input;
-      PIDAT_input_ave = 0;
-      PIDAT_count_input = 0;
+  if(pidat.count_input >= PIDAT_SAMPLES)
+  {
+    pidat.input = pidat.input_ave / (float)pidat.count_input;
+    pidat.input_ave = 0;
+    pidat.count_input = 0;
       
-      PIDAT_max=max(PIDAT_max,PIDAT_input);
-      PIDAT_min=min(PIDAT_min,PIDAT_input);
+    pidat.max=max(pidat.max,pidat.input);
+    pidat.min=min(pidat.min,pidat.input);
 
-      if(PIDAT_heating == true && PIDAT_input > PIDAT_test_temp) 
-      {
-        if(timestamp - PIDAT_t2 > 5000) 
-        { 
-          PIDAT_heating = false;
-          PIDAT_PWM_val = (PIDAT_bias - PIDAT_d);
-          PIDAT_t1 = timestamp;
-          PIDAT_t_high = PIDAT_t1 - PIDAT_t2;
-          PIDAT_max = PIDAT_test_temp;
-        }
+    if(pidat.heating == true && pidat.input > pidat.test_temp) 
+    {
+      if(timestamp - pidat.t2 > 5000) 
+      { 
+        pidat.heating = false;
+        pidat.PWM_val = (pidat.bias - pidat.d);
+        pidat.t1 = timestamp;
+        pidat.t_high = pidat.t1 - pidat.t2;
+        pidat.max = pidat.test_temp;
       }
+    }
       
-      if((PIDAT_heating == false) && (PIDAT_input < PIDAT_test_temp)) 
+    if((pidat.heating == false) && (pidat.input < pidat.test_temp)) 
+    {
+      if(timestamp - pidat.t1 > 5000) 
       {
-        if(timestamp - PIDAT_t1 > 5000) 
-        {
-          PIDAT_heating = true;
-          PIDAT_t2 = timestamp;
-          PIDAT_t_low = PIDAT_t2 - PIDAT_t1;
+        pidat.heating = true;
+        pidat.t2 = timestamp;
+        pidat.t_low = pidat.t2 - pidat.t1;
           
-          if(PIDAT_cycles > 0) 
+        if(pidat.cycles > 0) 
+        {
+          pidat.bias += (pidat.d*(pidat.t_high - pidat.t_low))/(pidat.t_low + pidat.t_high);
+          pidat.bias = constrain(pidat.bias, 20 ,hotend->max_pwm - 20);
+          if(pidat.bias > (hotend->max_pwm/2))
           {
-            PIDAT_bias += (PIDAT_d*(PIDAT_t_high - PIDAT_t_low))/(PIDAT_t_low + PIDAT_t_high);
-            PIDAT_bias = constrain(PIDAT_bias, 20 ,hotend->max_pwm - 20);
-            if(PIDAT_bias > (hotend->max_pwm/2))
-            {
-              PIDAT_d = (hotend->max_pwm - 1) - PIDAT_bias;
-            } else {
-              PIDAT_d = PIDAT_bias;
-            }
-            usb_printf(" bias: %d  d: %d  min: %d  max: %d \r\n",(int)PIDAT_bias,(int)PIDAT_d,(int)PIDAT_min,(int)PIDAT_max);
+            pidat.d = (hotend->max_pwm - 1) - pidat.bias;
+          } else {
+            pidat.d = pidat.bias;
+          }
+          usb_printf(" bias: %d  d: %d  min: %d  max: %d \r\n",(int)pidat.bias,(int)pidat.d,(int)pidat.min,(int)pidat.max);
             
-            if(PIDAT_cycles > 2) 
-            {
-              PIDAT_Ku = (4.0*PIDAT_d)/(3.14159*(PIDAT_max-PIDAT_min));
-              PIDAT_Tu = ((float)(PIDAT_t_low + PIDAT_t_high)/1000.0);
+          if(pidat.cycles > 2) 
+          {
+            float Ku = (4.0*pidat.d)/(3.14159*(pidat.max-pidat.min));
+            float Tu = ((float)(pidat.t_low + pidat.t_high)/1000.0);
               
-              usb_printf(" Ku: %d  Tu: %d \r\n",(int)PIDAT_Ku,(int)PIDAT_Tu);
+            usb_printf(" Ku: %d  Tu: %d \r\n",(int)Ku,(int)Tu);
 
             // reference http://en.wikipedia.org/wiki/Ziegler%E2%80%93Nichols_method
-
-              PIDAT_Kp = 0.60*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/8;
-
-              printf(" P:%u, I:%u, D:%u\r\n",(unsigned)(PIDAT_Kp*1000),(unsigned)(PIDAT_Ki*1000),(unsigned)(PIDAT_Kd*1000));
-              usb_printf(" Clasic PID \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n", (unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-              usb_printf("  Set with M301 P%u I%u D%u\r\n", (unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-              PIDAT_Kp = 0.33*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/3;
-
-              usb_printf(" Some overshoot \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n",(unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-              usb_printf("  Set with M301 P%u I%u D%u\r\n", (unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-              PIDAT_Kp = 0.20*PIDAT_Ku;
-              PIDAT_Ki = 2*PIDAT_Kp/PIDAT_Tu;
-              PIDAT_Kd = PIDAT_Kp*PIDAT_Tu/3;
-
-              usb_printf(" No overshoot \r\n  CFG Kp: %u \r\n  CFG Ki: %u \r\n  CFG Kd: %u \r\n",(unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-              usb_printf("  Set with M301 P%u I%u D%u\r\n", (unsigned int)(PIDAT_Kp*256),(unsigned int)(PIDAT_Ki*PIDAT_TIME_FACTOR),(unsigned int)(PIDAT_Kd*PIDAT_TIME_FACTOR));
-
-            }
+            PID_autotune_report("Clasic PID", Ku, Tu, 0.60, 8);
+            PID_autotune_report("Some overshoot", Ku, Tu, 0.33, 3);
+            PID_autotune_report("No overshoot", Ku, Tu, 0.20, 3);
           }
-          PIDAT_PWM_val = (PIDAT_bias + PIDAT_d);
-          PIDAT_cycles++;
-          PIDAT_min = PIDAT_test_temp;
         }
-      } 
+        pidat.PWM_val = (pidat.bias + pidat.d);
+        pidat.cycles++;
+        pidat.min = pidat.test_temp;
+      }
+    } 
       
-    PIDAT_PWM_val = constrain(PIDAT_PWM_val, 0, hotend->max_pwm);
-    hotend->pwm = (unsigned char)PIDAT_PWM_val;
-    }
+    pidat.PWM_val = constrain(pidat.PWM_val, 0, hotend->max_pwm);
+    hotend->pwm = pidat.PWM_val;
+  }
 
-    if((PIDAT_input < (10)) || (PIDAT_input > 255))
-    {
-      usb_printf("PID Autotune failed! Double check thermistor connection \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-      autotune_active = false;
-      return;
-    }
+  if((pidat.input < (10)) || (pidat.input > 255))
+  {
+    usb_printf("PID Autotune failed! Double check thermistor connection \r\n");
+    PID_autotune_stop();
+    return;
+  }
 
-    if((PIDAT_input > (PIDAT_test_temp + 55)) || (PIDAT_input > 255))
-    {
-      usb_printf("PID Autotune failed! Temperature too high \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-      autotune_active = false;
-      return;
-    }
+  if((pidat.input > (pidat.test_temp + 55)) || (pidat.input > 255))
+  {
+    usb_printf("PID Autotune failed! Temperature too high \r\n");
+    PID_autotune_stop();
+    return;
+  }
     
-    if(timestamp - PIDAT_temp_millis > 2000) 
-    {
-      PIDAT_temp_millis = timestamp;
-      usb_printf("ok T: %u  @:%u \r\n",(unsigned char)PIDAT_input,(unsigned char)PIDAT_PWM_val);       
-    }
+  if(timestamp - pidat.temp_millis > 2000) 
+  {
+    pidat.temp_millis = timestamp;
+    usb_report("T:%u @:%u \r\n",(unsigned char)pidat.input,(unsigned char)pidat.PWM_val);       
+  }
     
-    if(((timestamp - PIDAT_t1) + (timestamp - PIDAT_t2)) > (10L*60L*1000L*2L)) 
-    {
-      usb_printf("PID Autotune failed! timeout \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-      autotune_active = false;
-      return;
-    }
+  if(((timestamp - pidat.t1) + (timestamp - pidat.t2)) > (10L*60L*1000L*2L)) 
+  {
+    usb_printf("PID Autotune failed! timeout \r\n");
+    PID_autotune_stop();
+    return;
+  }
     
-    if(PIDAT_cycles > 5) 
-    {
-      usb_printf("PID Autotune finished! Set new values with M301 \r\n");
-      hotend->target_temp = 0;
-      hotend->pwm = 0;
-	    autotune_active = false;
-      return;
-    }
+  if(pidat.cycles > 5) 
+  {
+    usb_printf("PID Autotune finished! Set new values with %s \r\n", (pidat.hotend == &bed_heater) ? "M304" : "M301");
+    PID_autotune_stop();
+    return;
   }
 }
 //---------------- END AUTOTUNE PID ------------------------------
@@ -820,89 +990,163 @@ void PID_autotune(heater_struct *hotend, float PIDAT_test_temp)
 // Calculate slope and y-intercept for setpoint pwm formula.
 // Setting these constants correctly will greatly improve PID performance.
 //
+// The PID holds the hotend at several setpoints. Once the temperature has
+// stayed within HEATER_CAL_BAND for HEATER_CAL_SETTLE, the average pwm is
+// taken as the steady-state duty of that setpoint. A least squares line
+// through these points gives slope and intercept, which are stored in the
+// parameters. Stepped from manage_heaters() like the autotune.
 //------------------------------------------------------------------
 
-void Heater_Eval(heater_struct *hotend, unsigned int step)
+static struct {
+  unsigned char extruder;
+  unsigned char points;
+  unsigned char point;
+  signed short low;
+  signed short high;
+  unsigned long point_start;
+  unsigned long settle_start;
+  unsigned long pwm_sum;
+  unsigned int pwm_count;
+  unsigned long report_millis;
+  signed short temp[HEATER_CAL_MAX_POINTS];
+  unsigned char duty[HEATER_CAL_MAX_POINTS];
+} hcal;
+
+static signed short Heater_Eval_setpoint(unsigned char point)
 {
-  unsigned long temp_millis = timestamp;
-  unsigned long T_check;
-  unsigned int pwm;
-  float input = 25;
-  float input_ave;
-  unsigned int points[2][20];
-  unsigned int count = 0;
+  return hcal.low + ((hcal.high - hcal.low) * point) / (hcal.points - 1);
+}
 
-#define X 0
-#define Y 1
+static void Heater_Eval_next(void)
+{
+  eval_heater->target_temp = Heater_Eval_setpoint(hcal.point);
+  hcal.point_start = timestamp;
+  hcal.settle_start = timestamp;
+  hcal.pwm_sum = 0;
+  hcal.pwm_count = 0;
+}
 
-  usb_printf("Find equation of temperature to heater pwm \r\n\n");
+static void Heater_Eval_stop(void)
+{
+  eval_heater->target_temp = 0;
+  eval_heater = NULL;
+}
 
-  autotune_active = true;  // disable PID while running
+unsigned char Heater_Eval(unsigned char extruder, signed short low, signed short high, unsigned char points)
+{
+  if(eval_heater != NULL || autotune_heater != NULL || extruder >= MAX_EXTRUDER)
+    return false;
+
+  eval_heater = &heaters[extruder];
+  hcal.extruder = extruder;
+  hcal.points = constrain(points, 2, HEATER_CAL_MAX_POINTS);
+  hcal.low = low;
+  hcal.high = max(high, low + hcal.points - 1);
+  hcal.point = 0;
+  hcal.report_millis = timestamp;
+
+  usb_printf("Find equation of temperature to heater pwm \r\n");
+  Heater_Eval_next();
+  return true;
+}
 
-  #ifdef BED_USES_THERMISTOR
-    bed_heater.target_temp = 0;
-    heater_switch(HEATER_BED, 0);
-    LED_switch(3,0);
-  #endif
+void Heater_Eval_cancel(void)
+{
+  if(eval_heater == NULL)
+    return;
 
-  for(pwm = step; pwm < hotend->max_pwm; pwm+=step) 
-  {
-    hotend->pwm = pwm;
-    input_ave = 0;
-    T_check = timestamp;
-    while((unsigned int)input != (unsigned int)input_ave)
-    {
-      if((timestamp - T_check) > 500 )
-      {
-        T_check = timestamp;
-        input = analog2temp_convert(adc_read(hotend->ad_cannel),hotend->thermistor_type);
-        input_ave += (input - input_ave)/25;
-      }
-      if( input > 195 ) break;
-      if(timestamp - temp_millis > 2000) 
-      {
-        temp_millis = timestamp;
-        usb_printf("ok T:%u  A:%u  @:%u\r\n",(unsigned int)input,(unsigned int)input_ave,pwm);       
-      }
-    }
-    if( input > 195) break;
-    points[X][count] = (unsigned char)input;
-    points[Y][count] = pwm;
-    printf("{%u,%u} ",points[X][count],points[Y][count]);
-    if( count++ > 20 ) break;
-  }
-  printf("\r\n\n");
-  hotend->target_temp = 0;
-  hotend->pwm = 0;
-  autotune_active = false;
-  
-  unsigned int x_sum = 0;
-  unsigned int y_sum = 0;
-  unsigned long xy_sum = 0;
-  unsigned long x2_sum = 0;
+  Heater_Eval_stop();
+  usb_printf("Heater evaluation canceled \r\n");
+}
+
+static void Heater_Eval_fit(void)
+{
+  heater_struct *hotend = eval_heater;
+  signed long x_sum = 0;
+  signed long y_sum = 0;
+  float xy_sum = 0;
+  float x2_sum = 0;
   signed short slope;
   signed short intercept;
   unsigned char i;
-  unsigned char max_pwm;
-  
+  unsigned char count = hcal.point;
+
   for(i=0; i<count; i++)
   {
-    x_sum += points[X][i];
-    y_sum += points[Y][i];
-    xy_sum += points[X][i] * points[Y][i];
-    x2_sum += points[X][i] * points[X][i];
+    x_sum += hcal.temp[i];
+    y_sum += hcal.duty[i];
+    xy_sum += (float)hcal.temp[i] * hcal.duty[i];
+    x2_sum += (float)hcal.temp[i] * hcal.temp[i];
   }
-  printf("count = %d, x_sum = %u, y_sum = %u, xy_sum = %u, x2_sum = %u \r\n",count,x_sum,y_sum,(unsigned int)xy_sum,(unsigned int)x2_sum);
 
-  slope = (int)((float)(((count * xy_sum) - (x_sum * y_sum)) * 256) / ((count * x2_sum) - (x_sum * x_sum)) + 0.5);
-  intercept = ((y_sum - (((float)(slope * x_sum)/256.0)) + 0.5) / (count));
-  
-  max_pwm = (unsigned char)min((((long)slope*(long)200>>8)+intercept)*4,255);
+  slope = (signed short)(((count * xy_sum - (float)x_sum * y_sum) * 256) / (count * x2_sum - (float)x_sum * x_sum) + 0.5);
+  intercept = (signed short)floor((y_sum - ((float)slope * x_sum) / 256.0) / count + 0.5);
+
+  hotend->slope = pa.heater_slope[hcal.extruder] = slope;
+  hotend->intercept = pa.heater_intercept[hcal.extruder] = intercept;
+
+  usb_printf("HEATER_SLOPE = %d, HEATER_INTERCEPT = %d \r\n", slope, intercept);
+  usb_printf("Heater evaluation finished, store with M500 \r\n");
+}
+
+void Heater_Eval_step(void)
+{
+  heater_struct *hotend = eval_heater;
+  signed short target;
+
+  if(eval_heater == NULL)
+    return;
+
+  target = Heater_Eval_setpoint(hcal.point);
+
+  if(hotend->target_temp != target)
+  {
+    // changed by a command or MINTEMP/MAXTEMP
+    usb_printf("Heater evaluation failed! Target changed \r\n");
+    Heater_Eval_stop();
+    return;
+  }
+
+  if(timestamp - hcal.point_start > HEATER_CAL_TIMEOUT)
+  {
+    usb_printf("Heater evaluation failed! timeout at %d \r\n", target);
+    Heater_Eval_stop();
+    return;
+  }
+
+  if(abs(hotend->akt_temp - target) > HEATER_CAL_BAND || hotend->pwm >= hotend->max_pwm)
+  {
+    hcal.settle_start = timestamp;
+    hcal.pwm_sum = 0;
+    hcal.pwm_count = 0;
+  }
+  else
+  {
+    hcal.pwm_sum += hotend->pwm;
+    hcal.pwm_count++;
+  }
+
+  if(timestamp - hcal.report_millis > 2000)
+  {
+    hcal.report_millis = timestamp;
+    usb_report("T:%u S:%d @:%u \r\n", (unsigned int)hotend->akt_temp, target, (unsigned int)hotend->pwm);
+  }
+
+  if(timestamp - hcal.settle_start < HEATER_CAL_SETTLE || hcal.pwm_count == 0)
+    return;
+
+  hcal.temp[hcal.point] = target;
+  hcal.duty[hcal.point] = (unsigned char)((hcal.pwm_sum + hcal.pwm_count / 2) / hcal.pwm_count);
+  usb_printf("{%d,%u} \r\n", hcal.temp[hcal.point], (unsigned int)hcal.duty[hcal.point]);
+  hcal.point++;
+
+  if(hcal.point < hcal.points)
+  {
+    Heater_Eval_next();
+    return;
+  }
 
-  usb_printf("HEATER_SLOPE = %d, HEATER_INTERCEPT = %d \r\n", slope, intercept);  
-  usb_printf("Heater evaluation finished \r\n");
-  usb_printf("Recommended HEATER_MAX_PWM: %u \r\n",max_pwm);
-  usb_printf("Use M301 S%u B%d W%u to set values\r\n", slope, intercept, max_pwm);
-  return;
+  Heater_Eval_fit();
+  Heater_Eval_stop();
 }
 //---------------- END EVALUATE HEATER ------------------------------
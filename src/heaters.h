@@ -78,10 +78,16 @@
 
 
 signed short temp2analog_thermistor_compute(signed short celsius, const float beta, const float rs, const float r_inf);
-signed short analog2temp_thermistor_compute(signed short raw, const float beta, const float rs, const float r_inf);
 
 signed short temp2analog_thermistor_table(signed short celsius, const short table[][2], signed short numtemps);
-signed short analog2temp_thermistor_table(signed short raw,const short table[][2], signed short numtemps);
+
+//temperature sensors with a lookup table, see temp_table_build()
+#define TEMP_SENSOR_BED	MAX_EXTRUDER
+#define TEMP_SENSORS	(MAX_EXTRUDER + 1)
+
+void temp_table_build(unsigned char sensor, unsigned char sensortype);
+signed short temp_table_read(unsigned char sensor, unsigned int raw);
+signed short temp_table_read16(unsigned char sensor, unsigned int raw);
 
 
 #define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
@@ -93,28 +99,34 @@ void manage_heaters(void);
 void init_heaters_values(void);
 void heater_switch(unsigned char heater, unsigned char en);
 void LED_switch(unsigned char led, unsigned char en);
-//void heater_soft_pwm(void);
+void heater_soft_pwm(void);
 
 
 typedef struct {
 	signed short target_temp;
 	signed short akt_temp;
+	signed short akt_temp16;	// 1/16 C
 	unsigned char pwm;
 	unsigned char soft_pwm_aktiv;
-	unsigned short PID_Kp;
-	unsigned short PID_I;
-	unsigned short PID_Kd;
+	unsigned short PID_Kp;		// 256 = 1 pwm step per C
+	unsigned short PID_I;		// 256 = 1 pwm step per C and second
+	unsigned short PID_Kd;		// 256 = 1 pwm step per C/s
+	unsigned short FF_gain;		// 256 = 1 pwm step per mm/s of filament
 	
 	unsigned char io_adr;
 	unsigned char ad_cannel;
+	unsigned char sensor;		// temp_table index
 	
-	signed short temp_iState;
-	signed short prev_temp;
+	signed long temp_iState;	// integrated error in 1/16 C * ms
+	signed short prev_temp16;
+	signed long dState;		// filtered slope in 1/16 C/s
+	unsigned long prev_millis;
 	signed short pTerm;
 	signed short iTerm;
 	signed short dTerm;
-	signed short temp_iState_min;
-	signed short temp_iState_max;
+	signed short ffTerm;
+	signed long temp_iState_min;
+	signed long temp_iState_max;
 	
 	signed short thermistor_type;
 	
@@ -124,14 +136,24 @@ typedef struct {
 
 } heater_struct;
 
-typedef struct {
-	signed short target_temp;
-	signed short akt_temp;
-	signed short thermistor_type;
 
-} heater_bed_struct;
 
+//one control tick of one heater, see heater_log_get()
+typedef struct {
+	unsigned long time;			// ms
+	unsigned char heater;		// 0.. hotends, TEMP_SENSOR_BED
+	unsigned char pwm;
+	signed short target_temp;
+	signed short akt_temp16;	// 1/16 C
+	signed short pTerm;
+	signed short iTerm;
+	signed short dTerm;
+	signed short ffTerm;
+} heater_log_entry;
 
+unsigned int heater_log_count(void);
+const heater_log_entry* heater_log_get(unsigned int idx);
+void heater_log_clear(void);
 
 extern signed short bed_temp_celsius;
 extern signed short hotend1_temp_celsius;
@@ -139,11 +161,16 @@ extern signed short hotend2_temp_celsius;
 extern signed short target_hotend1;
 
 extern heater_struct heaters[];
-extern heater_bed_struct bed_heater;
+extern heater_struct bed_heater;
 
 extern volatile unsigned char g_pwm_value[];
 extern volatile unsigned char g_pwm_aktiv[];
 
-void PID_autotune(heater_struct *hotend, float PIDAT_test_temp);
-void Heater_Eval(heater_struct *hotend, unsigned int step);
+void heater_PID_limits(heater_struct *heater);
+unsigned char PID_autotune(heater_struct *hotend, float PIDAT_test_temp);
+void PID_autotune_step(void);
+void PID_autotune_cancel(void);
+unsigned char Heater_Eval(unsigned char extruder, signed short low, signed short high, unsigned char points);
+void Heater_Eval_step(void);
+void Heater_Eval_cancel(void);
 
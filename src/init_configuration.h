@@ -152,6 +152,17 @@
 #define _DEF_CHAR_UUID "00000000-0000-0000-0000-000000000000"
 
 
+//-----------------------------------------------------------------------
+//// USB SERIAL
+//-----------------------------------------------------------------------
+// What to do with periodic reports (temperatures while waiting for heaters, autotune progress)
+// when the host does not read fast enough. Replies ("ok" etc.) are always kept.
+#define USB_TX_BLOCK            0   // reports wait for free space like replies
+#define USB_TX_DROP_TELEMETRY   1   // up to 4 reports are queued, the oldest is dropped
+#define USB_TX_COALESCE         2   // only the newest report is kept
+#define USB_TX_FULL_POLICY USB_TX_DROP_TELEMETRY
+
+
 //-----------------------------------------------------------------------
 //// HEATERCONTROL AND PID PARAMETERS
 //-----------------------------------------------------------------------
@@ -162,8 +173,20 @@
 	//PID Controler Settings
 	#define PID_INTEGRAL_DRIVE_MAX 80 // too big, and heater will lag after changing temperature, too small and it might not compensate enough for long-term errors
 	#define PID_PGAIN 2560 //256 is 1.0  // value of X means that error of 1 degree is changing PWM duty by X, probably no need to go over 25
-	#define PID_IGAIN 64 //256 is 1.0  // value of X (e.g 0.25) means that each degree error over 1 sec (2 measurements) changes duty cycle by 2X (=0.5) units (verify?)
-	#define PID_DGAIN 4096 //256 is 1.0  // value of X means that around reached setpoint, each degree change over one measurement (half second) adjusts PWM by X units to compensate
+	#define PID_IGAIN 128 //256 is 1.0  // value of X means that each degree error over 1 sec changes duty cycle by X units
+	#define PID_DGAIN 2048 //256 is 1.0  // value of X means that a temperature change of 1 degree per second adjusts PWM by X units to compensate
+	#define PID_D_FILTER 2 // the D term follows the measured slope with a weight of 1/2^PID_D_FILTER per sample
+	#define PID_MAX_DT 2000 // (ms) a longer gap between two samples restarts the D term
+
+	// Feed-forward from the extrusion rate, set with M301 F. 256 = 1 PWM step per mm/s of
+	// filament. The executing block and HEATER_FF_LOOKAHEAD blocks after it are looked at.
+	#define HEATER_FF_GAIN 0
+	#define HEATER_FF_LOOKAHEAD 2
+
+	// PID for the heatbed, same units, set with M304
+	#define BED_PID_PGAIN 2560
+	#define BED_PID_IGAIN 8
+	#define BED_PID_DGAIN 25600
 
 	// magic formula 1, to get approximate "zero error" PWM duty. Take few measurements with low PWM duty and make linear fit to get the formula
 	// for my makergear hot-end: linear fit {50,10},{60,20},{80,30},{105,50},{176,100},{128,64},{208,128}
@@ -188,11 +211,39 @@
 // Change this value (range 1-255) to limit the current to the nozzle
 #define HEATER_0_MAX_PWM 255
 #define HEATER_1_MAX_PWM 50
+#define BED_MAX_PWM 255
+
+// Slope and intercept calibration (M306): the PID holds each setpoint until the temperature
+// stayed within +/- HEATER_CAL_BAND for HEATER_CAL_SETTLE, the average pwm is one point of the fit
+#define HEATER_CAL_LOW 100			// (C) lowest setpoint, the highest is given with M306 S
+#define HEATER_CAL_MAX_POINTS 8
+#define HEATER_CAL_BAND 1			// (C)
+#define HEATER_CAL_SETTLE 60000		// (milliseconds)
+#define HEATER_CAL_TIMEOUT 900000	// (milliseconds) per setpoint
+
+// The bed is switched by a zero-crossing SSR: modulate it with one on/off decision every
+// BED_SSR_MODULATION milliseconds (10 = one half wave at 50 Hz) instead of the 370 Hz PWM.
+//#define BED_SSR_MODULATION 10
+
+// Dynamic motor current (M909), in percent of the current set with M906/M907.
+// The idle current is used after MOTOR_IDLE_TIME seconds without a move (0 = never),
+// the acceleration current while a move speeds up or slows down.
+#define MOTOR_IDLE_CURRENT 50
+#define MOTOR_ACCEL_CURRENT 100
+#define MOTOR_IDLE_TIME 30
+
+// Dynamic microstepping (M350 R): X, Y and Z set to 1/16 steps run in 1/4 steps while they
+// move faster than USTEP_SWITCH_RATE 1/16 steps per second (0 = never). The driver is
+// switched on a full step, so the position is kept exact.
+#define USTEP_SWITCH_RATE 16000
 
 // How often should the heater check for new temp readings, in milliseconds
 #define HEATER_CHECK_INTERVAL 250
 #define BED_CHECK_INTERVAL 5000
 
+// Control ticks kept for M633, one entry per active heater and tick (20 bytes each)
+#define HEATER_LOG_SIZE 64
+
 #define TEMP_HYSTERESIS 1       // (C) range of +/- temperatures considered "close" to the target one
 
 
@@ -205,6 +256,18 @@
 // Actual temperature must be close to target for this long before M109 returns success
 //#define TEMP_RESIDENCY_TIME 20  // (seconds)
 
+//// Heat-up of bed and hotend
+// M190 returns at once and the bed heats up together with the hotend. The wait for the bed
+// is done by the following M109, or before the first command that is not part of the heat-up. Changes the meaning of M190, enable it for hosts that expect it.
+//#define CONCURRENT_HEATUP
+
+// Hold back the hotend target while waiting for the bed, so that both reach their targets
+// at about the same time and the hotend does not ooze. Rates are measured while heating,
+// HOTEND_HEATUP_RATE is used for the hotend until it has been measured.
+//#define HEATUP_FINISH_TOGETHER
+#define HOTEND_HEATUP_RATE 2.0	// (C/s)
+#define HEATUP_SAMPLE_INTERVAL 4000	// (milliseconds)
+
 //// The minimal temperature defines the temperature below which the heater will not be enabled
 #define MINTEMP 5
 
@@ -17,6 +17,7 @@
 #include "planner.h"
 #include "gcode_parser.h"
 #include "sdcard.h"
+#include "scheduler.h"
 //#include "heaters.h"
 
 
@@ -32,16 +33,16 @@ extern void motor_enaxis(unsigned char axis, unsigned char en);
 extern void motor_setdir(unsigned char axis, unsigned char dir);
 extern void motor_step(unsigned char axis);
 extern void motor_unstep();
+extern void motor_current_idle(void);
 
 extern void heaters_setup();
 extern void manage_heaters(void);
-//extern void heater_soft_pwm(void);
-extern void ConfigureTc_1(void);
+extern void heater_soft_pwm(void);
 
 
 //extern void sprinter_mainloop();
 extern void initadc(int);
-extern void samserial_setcallback(void (*c)(unsigned char));
+extern void samserial_setcallback(unsigned int (*c)(const unsigned char*,unsigned int));
 
 
 #ifndef AT91C_ID_TC0
@@ -54,48 +55,47 @@ extern void samserial_setcallback(void (*c)(unsigned char));
 /// Global timestamp in milliseconds since start of application.
 volatile unsigned long timestamp = 1;
 
+#ifndef SYSTICK_IRQ_PRIORITY
+#define SYSTICK_IRQ_PRIORITY 15
+#endif
+
   
 //----------------------------------------------------------
 //SYSTICK --> INTERRUPT call every 1ms 
+//counts the time and runs the heater/fan modulation, periodic work is run
+//by the scheduler in the main loop
 //----------------------------------------------------------
 void SysTick_Handler(void)
 {
-	
 	timestamp++;
-	
-    if(timestamp%10==0)
-        adc_sample();
-    
-    
-    //temp control goes in here
-    //temp0 = chan 5 = adc_read(5) etc (returns unsigned absolute millivolt value).
-    //temp1 = chan 3
-    //temp2 = chan 1
-    //temp3 = chan 2
-    
-    //if(timestamp%1000==0)//every 1 second
-	//{
-	//  for(i=1;i<9;i++)
-    //  	printf("Channel %u : %u mV\n", i,adc_read(i));
-    //	
-	
-	if(timestamp%250==0) //every 100 ms
-    {
-		manage_heaters();
-    }
-	    
+	heater_soft_pwm();
 }
-unsigned long oldtimestamp=1;
-void do_periodic()
+
+static void manage_inactivity_task(void)
 {
-	if (timestamp==oldtimestamp)
-		return;
-	oldtimestamp=timestamp;
-	if (timestamp % 500 == 0)
-	{
-		sdcard_handle_state();
-	}
-	
+	manage_inactivity(1);
+	motor_current_idle();
+}
+
+//----------------------------------------------------------
+//main loop tasks, 0 is the highest priority. the planner is fed first,
+//housekeeping runs after it. M632 shows the runtime of each task.
+//----------------------------------------------------------
+static void setup_tasks(void)
+{
+	scheduler_init();
+	scheduler_add("gcode",gcode_update,0,SCHED_POLL,0);
+	scheduler_add("usb",samserial_poll,1,SCHED_POLL,0);
+	
+	//temp control: temp0 = chan 5 = adc_read(5) etc (returns unsigned absolute millivolt value).
+	//temp1 = chan 3
+	//temp2 = chan 1
+	//temp3 = chan 2
+	scheduler_add("adc",adc_sample,2,10,10);
+	scheduler_add("heaters",manage_heaters,3,250,50);
+	scheduler_add("inactivity",manage_inactivity_task,4,100,0);
+	scheduler_add("sdread",sdcard_prefetch,5,SCHED_POLL,0);
+	scheduler_add("sdcard",sdcard_handle_state,6,500,0);
 }
 
 
@@ -136,6 +136,7 @@ int main()
     //-------- Start SYSTICK (1ms) --------------
 	printf("Configuring systick.\n\r");
 	SysTick_Configure(1, BOARD_MCK/1000, SysTick_Handler);
+	NVIC_SetPriority(SysTick_IRQn, SYSTICK_IRQ_PRIORITY);
 	
 	//-------- Timer 0 for Stepper --------------
 	printf("Init Stepper IO\n\r");
@@ -146,16 +147,14 @@ int main()
 	printf("Configuring Timer 0 Stepper\n\r");
     ConfigureTc0_Stepper();	//Timer for Stepper
 	
-	//-------- Timer 1 for heater PWM --------------
-	printf("Configuring Timer 1 PWM.\n\r");
-	ConfigureTc_1();
-
 	//-------- Init Planner Values --------------
 	printf("Plan Init\n\r");
 	plan_init();
 	
 	printf("G-Code parser init\n\r");
-	gcode_init(usb_printf);
+	gcode_init(usb_printf,usb_report);
+	
+	setup_tasks();
 	
 	//-------- Check for SD card presence -------
 //	sdcard_handle_state();
@@ -167,9 +166,7 @@ int main()
   		//uncomment to use//sprinter_mainloop();
     	//main loop events go here
 
-		do_periodic();
-
-		gcode_update();
+		scheduler_run();
 /*    	
 		if(buflen < (BUFSIZE-1))
 			get_command();
@@ -1,14 +1,17 @@
 #include <board.h>
 #include <pio/pio.h>
+#include <irq/irq.h>
 #include <stdio.h>
 #include "init_configuration.h"
 #include "parameters.h"
+#include "util.h"
+#include "motoropts.h"
 
 
-
-const Pin MOSI={1 <<  14, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin SCK={1 <<  15, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_0, PIO_PULLUP};
-const Pin CS={1 <<  16, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_OUTPUT_1, PIO_PULLUP};
+//AD5206 digipot on SPI0: MOSI, SPCK and NPCS0 are peripheral A of PA14..PA16
+const Pin MOSI={1 <<  14, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_PERIPH_A, PIO_DEFAULT};
+const Pin SCK={1 <<  15, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_PERIPH_A, PIO_DEFAULT};
+const Pin CS={1 <<  16, AT91C_BASE_PIOA, AT91C_ID_PIOA, PIO_PERIPH_A, PIO_PULLUP};
 
 const Pin XMS1={1 <<  30, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_PULLUP};
 const Pin XMS2={1 <<  29, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_PULLUP};
@@ -37,47 +40,164 @@ const Pin E1STEP={1 <<  1, AT91C_BASE_PIOB, AT91C_ID_PIOB, PIO_OUTPUT_0, PIO_PUL
 const Pin E1DIR={1 <<  25, AT91C_BASE_PIOC, AT91C_ID_PIOC, PIO_OUTPUT_0, PIO_PULLUP};
 
 
-void AD5206_sendbit(unsigned char bit){
-    volatile unsigned int uDummy;
-    for (uDummy=0; uDummy<512; ++uDummy);
-    PIO_Clear(&SCK);
-    if(bit)
-        PIO_Set(&MOSI);
-    else
-        PIO_Clear(&MOSI);
-    for (uDummy=0; uDummy<512; ++uDummy);
-    PIO_Set(&SCK);
-}
-    
-void AD5206_setchan(unsigned char chan, unsigned char value){
-    
-    PIO_Set(&CS);
-    volatile unsigned int uDummy;
-    for (uDummy=0; uDummy<10000; ++uDummy);
-    PIO_Clear(&SCK);
-    PIO_Set(&MOSI);
-    int i;
-    PIO_Clear(&CS); //Enable chip
-    for(i=0;i<3;i++){
-        AD5206_sendbit((chan&(1<<(2-i)))>0);
+#define AD5206_CHANNELS 6
+#define AD5206_SPI_CLOCK 1000000
+
+#ifndef SPI0_IRQ_PRIORITY
+#define SPI0_IRQ_PRIORITY (14 << 8)	// preemption level in bits 15:8, see IRQ_ConfigureIT()
+#endif
+
+//values waiting to be sent, one per channel, so a newer value replaces an older one
+static volatile unsigned char AD5206_value[AD5206_CHANNELS];
+static volatile unsigned char AD5206_pending = 0;	//channel mask
+static volatile unsigned char AD5206_busy = 0;
+
+//start the transfer of the next pending channel, called with interrupts disabled
+static void AD5206_send_next(void)
+{
+    unsigned char chan;
+
+    for(chan=0;chan<AD5206_CHANNELS;chan++){
+        if(AD5206_pending & (1<<chan))
+            break;
     }
-    for(i=0;i<8;i++){
-        AD5206_sendbit((value&(1<<(7-i)))>0);
+
+    if(chan == AD5206_CHANNELS){
+        AT91C_BASE_SPI0->SPI_IDR = AT91C_SPI_TXEMPTY;
+        AD5206_busy = 0;
+        return;
     }
-    PIO_Clear(&SCK);
-    PIO_Set(&CS);
 
+    AD5206_pending &= ~(1<<chan);
+    AD5206_busy = 1;
+    //11 bit word: 3 bit address, 8 bit value, latched when NPCS0 rises
+    AT91C_BASE_SPI0->SPI_TDR = ((unsigned int)chan << 8) | AD5206_value[chan];
+    AT91C_BASE_SPI0->SPI_IER = AT91C_SPI_TXEMPTY;
+}
+
+void SPI0_IrqHandler(void)
+{
+    if(AT91C_BASE_SPI0->SPI_SR & AT91C_SPI_TXEMPTY)
+        AD5206_send_next();
+}
+
+//queue a new value for a channel, returns at once
+void AD5206_setchan(unsigned char chan, unsigned char value){
+    unsigned int state;
+
+    if(chan >= AD5206_CHANNELS)
+        return;
+
+    state = irq_save();
+    AD5206_value[chan] = value;
+    AD5206_pending |= 1<<chan;
+    if(!AD5206_busy)
+        AD5206_send_next();
+    irq_restore(state);
 }
 
 void AD5206_setup(){
     Pin SPIPINS[]={MOSI,SCK,CS};
 
     PIO_Configure(SPIPINS,3);
-    
-    PIO_Set(&CS);
-    
+
+    AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_SPI0;
+    AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SPIDIS;
+    AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SWRST;
+    //master, fixed peripheral NPCS0
+    AT91C_BASE_SPI0->SPI_MR = AT91C_SPI_MSTR | AT91C_SPI_MODFDIS | (0xE << 16);
+    //data is taken on the rising edge, chip select rises after every word
+    AT91C_BASE_SPI0->SPI_CSR[0] = AT91C_SPI_NCPHA | AT91C_SPI_CSNAAT | AT91C_SPI_BITS_11
+        | ((BOARD_MCK / AD5206_SPI_CLOCK) << 8) | (3 << 24);
+    AT91C_BASE_SPI0->SPI_IDR = 0xFFFFFFFF;
+
+    IRQ_ConfigureIT(AT91C_ID_SPI0, SPI0_IRQ_PRIORITY, SPI0_IrqHandler);
+    IRQ_EnableIT(AT91C_ID_SPI0);
+
+    AT91C_BASE_SPI0->SPI_CR = AT91C_SPI_SPIEN;
+}
+
+
+//------------------------------------------------------------------------------
+// Dynamic motor current: pa.motor_boost_current percent of the set current while
+// accelerating or decelerating, the set current at cruise speed and
+// pa.motor_idle_current percent after pa.motor_idle_time seconds without a move.
+// The stepper interrupt switches the levels at block and phase boundaries.
+//------------------------------------------------------------------------------
+extern volatile unsigned long timestamp;
+
+static const unsigned char motor_channel[5] = {3,1,0,2,5};	//AD5206 channel of X, Y, Z, E0, E1
+static volatile unsigned char motor_level[5];				//MOTOR_CURRENT_RUN ..
+static volatile unsigned long motor_last_active[5];
+static volatile unsigned char motor_active_axes = 0;		//axes of the block being stepped
+
+static unsigned char motor_scale_current(unsigned char current, unsigned char level)
+{
+    unsigned int scaled = current;
+
+    if(level == MOTOR_CURRENT_IDLE)
+        scaled = scaled * pa.motor_idle_current / 100;
+    else if(level == MOTOR_CURRENT_BOOST)
+        scaled = scaled * pa.motor_boost_current / 100;
+
+    return (scaled > 255) ? 255 : (unsigned char)scaled;
+}
+
+static void motor_set_level(unsigned char axis, unsigned char level)
+{
+    if(motor_level[axis] == level)
+        return;
+
+    motor_level[axis] = level;
+    AD5206_setchan(motor_channel[axis], motor_scale_current(pa.axis_current[axis], level));
 }
 
+//a block starts or changes between acceleration and cruise, called by the stepper interrupt
+void motor_current_block(unsigned char axes, unsigned char level)
+{
+    unsigned char axis;
+
+    if(level == MOTOR_CURRENT_BOOST && pa.motor_boost_current == 100)
+        level = MOTOR_CURRENT_RUN;
+
+    motor_active_axes = axes;
+    for(axis=0;axis<5;axis++){
+        if(axes & (1<<axis)){
+            motor_last_active[axis] = timestamp;
+            motor_set_level(axis, level);
+        }
+    }
+}
+
+//the block is finished, called by the stepper interrupt
+void motor_current_block_end(void)
+{
+    unsigned char axis;
+
+    for(axis=0;axis<5;axis++){
+        if(motor_active_axes & (1<<axis))
+            motor_last_active[axis] = timestamp;
+    }
+    motor_active_axes = 0;
+}
+
+//lower the current of axes that did not move for pa.motor_idle_time, called from the main loop
+void motor_current_idle(void)
+{
+    unsigned char axis;
+    unsigned int state;
+
+    if(pa.motor_idle_time == 0)
+        return;
+
+    for(axis=0;axis<5;axis++){
+        state = irq_save();
+        if(!(motor_active_axes & (1<<axis)) && motor_level[axis] != MOTOR_CURRENT_IDLE
+            && timestamp - motor_last_active[axis] > (unsigned long)pa.motor_idle_time * 1000)
+            motor_set_level(axis, MOTOR_CURRENT_IDLE);
+        irq_restore(state);
+    }
+}
 
 //convert digipot count to mA
 unsigned int count_ma(unsigned char count)
@@ -125,36 +245,61 @@ unsigned char microstep_usteps(unsigned char mode)
 }
 
 
+//set the microstep mode pins of an axis, also used by the stepper interrupt
+void motor_setustep(unsigned char axis, unsigned char ustepbits){
+    const Pin *MS1;
+    const Pin *MS2;
+
+    switch(axis){
+        case 0:
+            MS1=&XMS1;
+            MS2=&XMS2;
+            break;
+        case 1:
+            MS1=&YMS1;
+            MS2=&YMS2;
+            break;
+        case 2:
+            MS1=&ZMS1;
+            MS2=&ZMS2;
+            break;
+        case 3:
+            MS1=&E0MS1;
+            MS2=&E0MS2;
+            break;
+        case 4:
+            MS1=&E1MS1;
+            MS2=&E1MS2;
+            break;
+        default:
+            return;
+    }
+    if(ustepbits&1)
+        PIO_Set(MS1);
+    else
+        PIO_Clear(MS1);
+    if(ustepbits&2)
+        PIO_Set(MS2);
+    else
+        PIO_Clear(MS2);
+}
 	
 void motor_setopts(unsigned char axis, unsigned char ustepbits, unsigned char current){
-    Pin MS1;
-    Pin MS2;
-    
     unsigned char channel;
     switch(axis){
         case 0:
-            MS1=XMS1;
-            MS2=XMS2;
             channel=3;
             break;
         case 1:
-            MS1=YMS1;
-            MS2=YMS2;
             channel=1;
             break;
         case 2:
-            MS1=ZMS1;
-            MS2=ZMS2;
             channel=0;
             break;
         case 3:
-            MS1=E0MS1;
-            MS2=E0MS2;
             channel=2;
             break;
         case 4:
-            MS1=E1MS1;
-            MS2=E1MS2;
             channel=5;
             break;
         case 6:
@@ -164,16 +309,10 @@ void motor_setopts(unsigned char axis, unsigned char ustepbits, unsigned char cu
         default:
             return;
     }
-    if(ustepbits<4){
-        if(ustepbits&1)
-            PIO_Set(&MS1);
-        else
-            PIO_Clear(&MS1);
-        if(ustepbits&2)
-            PIO_Set(&MS2);
-        else
-            PIO_Clear(&MS2);
-    }
+    if(ustepbits<4)
+        motor_setustep(axis,ustepbits);
+    if(axis < 5)
+        current = motor_scale_current(current, motor_level[axis]);
     AD5206_setchan(channel,current);
 
 	//printf("Setting channel %u to current value %u and ustep value %u\r\n",channel, current, ustepbits);
@@ -25,7 +25,17 @@ unsigned int count_ma(unsigned char count);
 unsigned char ma_count(unsigned int ma);
 unsigned char microstep_mode(unsigned char usteps);
 unsigned char microstep_usteps(unsigned char mode);
+void motor_setustep(unsigned char axis, unsigned char ustepbits);
 void motor_setopts(unsigned char axis, unsigned char ustepbits, unsigned char current);
+
+//current levels of the dynamic motor current
+#define MOTOR_CURRENT_RUN	0
+#define MOTOR_CURRENT_IDLE	1
+#define MOTOR_CURRENT_BOOST	2
+
+void motor_current_block(unsigned char axes, unsigned char level);
+void motor_current_block_end(void);
+void motor_current_idle(void);
 void motor_setup();
 
  
@@ -26,6 +26,7 @@
 #include "serial.h"
 #include "motoropts.h"
 #include "sdcard.h"
+#include "util.h"
 
 unsigned short calc_crc16(void);
 
@@ -118,6 +119,11 @@ void init_parameters(void)
 		pa.axis_ustep[cnt_c] = uc_temp2[cnt_c];
 	}
 	
+	pa.motor_idle_current = MOTOR_IDLE_CURRENT;
+	pa.motor_boost_current = MOTOR_ACCEL_CURRENT;
+	pa.motor_idle_time = MOTOR_IDLE_TIME;
+	pa.ustep_switch_rate = USTEP_SWITCH_RATE;
+	
 	pa.heater_thermistor_type[0] = THERMISTORHEATER;
 	pa.heater_thermistor_type[1] = THERMISTORHEATER;
 	pa.bed_thermistor_type = THERMISTORBED;
@@ -128,10 +134,12 @@ void init_parameters(void)
 	pa.heater_pTerm[0] = PID_PGAIN;
 	pa.heater_iTerm[0] = PID_IGAIN;
 	pa.heater_dTerm[0] = PID_DGAIN;
+	pa.heater_ff_gain[0] = HEATER_FF_GAIN;
 	
 	pa.heater_pTerm[1] = PID_PGAIN;
 	pa.heater_iTerm[1] = PID_IGAIN;
 	pa.heater_dTerm[1] = PID_DGAIN;
+	pa.heater_ff_gain[1] = HEATER_FF_GAIN;
 	
 	pa.heater_slope[0] = HEATER_0_SLOPE; 
 	pa.heater_intercept[0] = HEATER_0_INTERCEPT;
@@ -141,6 +149,10 @@ void init_parameters(void)
 	pa.heater_intercept[1] = HEATER_1_INTERCEPT;
 	pa.heater_max_pwm[1] = HEATER_1_MAX_PWM;
 	
+	pa.bed_pTerm = BED_PID_PGAIN;
+	pa.bed_iTerm = BED_PID_IGAIN;
+	pa.bed_dTerm = BED_PID_DGAIN;
+	
 }
 
 void FLASH_StoreSettings(void) 
@@ -255,8 +267,9 @@ void FLASH_PrintSettings(void)
 	usb_printf("; Endstop invert:\r\nM526 X%d Y%d Z%d\r\n",pa.x_endstop_invert,pa.y_endstop_invert,pa.z_endstop_invert);
 	usb_printf("; Axis invert:\r\nM510 X%d Y%d Z%d E%d\r\n",pa.invert_x_dir,pa.invert_y_dir,pa.invert_z_dir,pa.invert_e_dir);
 	
-	usb_printf("; Heater 1 PID:\r\nM301 T0 P%d I%d D%d\r\n",(int)pa.heater_pTerm[0],(int)pa.heater_iTerm[0],(int)pa.heater_dTerm[0]);
-	usb_printf("; Heater 2 PID:\r\nM301 T1 P%d I%d D%d\r\n",(int)pa.heater_pTerm[1],(int)pa.heater_iTerm[1],(int)pa.heater_dTerm[1]);
+	usb_printf("; Heater 1 PID, (F)eed-forward:\r\nM301 T0 P%d I%d D%d F%d\r\n",(int)pa.heater_pTerm[0],(int)pa.heater_iTerm[0],(int)pa.heater_dTerm[0],(int)pa.heater_ff_gain[0]);
+	usb_printf("; Heater 2 PID, (F)eed-forward:\r\nM301 T1 P%d I%d D%d F%d\r\n",(int)pa.heater_pTerm[1],(int)pa.heater_iTerm[1],(int)pa.heater_dTerm[1],(int)pa.heater_ff_gain[1]);
+	usb_printf("; Heatbed PID:\r\nM304 P%d I%d D%d\r\n",(int)pa.bed_pTerm,(int)pa.bed_iTerm,(int)pa.bed_dTerm);
 	
 	usb_printf("; Heater 1 Sensor Type:\r\nM530 T0 E%d\r\n",pa.heater_thermistor_type[0]);
 	usb_printf("; Heater 2 Sensor Type:\r\nM530 T1 E%d\r\n",pa.heater_thermistor_type[1]);
@@ -268,12 +281,14 @@ void FLASH_PrintSettings(void)
 	usb_printf("; Heater 1 Max pwm (range 0-255): \r\nM301 T0 W%d\r\n",pa.heater_max_pwm[0]);
 	usb_printf("; Heater 2 Max pwm (range 0-255): \r\nM301 T1 W%d\r\n",pa.heater_max_pwm[1]);
 	
-	usb_printf("; Heater 1 (S)lope, (I)ntercept:\r\nM301 T0 S%d I%d\r\n",pa.heater_slope[0],pa.heater_intercept[0]);
-	usb_printf("; Heater 2 (S)lope, (I)ntercept:\r\nM301 T1 S%d I%d\r\n",pa.heater_slope[1],pa.heater_intercept[1]);
+	usb_printf("; Heater 1 (S)lope, y-intercept (B):\r\nM301 T0 S%d B%d\r\n",pa.heater_slope[0],pa.heater_intercept[0]);
+	usb_printf("; Heater 2 (S)lope, y-intercept (B):\r\nM301 T1 S%d B%d\r\n",pa.heater_slope[1],pa.heater_intercept[1]);
 	
 	//usb_printf("; Motor Current \r\n  M907 X%d Y%d Z%d E%d B%d \r\n",pa.axis_current[0],pa.axis_current[1],pa.axis_current[2],pa.axis_current[3],pa.axis_current[4]);
 	usb_printf("; Motor Current (mA) (range 0-1900):\r\nM906 X%d Y%d Z%d E%d B%d \r\n",count_ma(pa.axis_current[0]),count_ma(pa.axis_current[1]),count_ma(pa.axis_current[2]),count_ma(pa.axis_current[3]),count_ma(pa.axis_current[4]));
-	usb_printf("; Motor Microstepping (1,2,4,8,16): \r\nM350 X%d Y%d Z%d E%d B%d \r\n",microstep_usteps(pa.axis_ustep[0]),microstep_usteps(pa.axis_ustep[1]),microstep_usteps(pa.axis_ustep[2]),microstep_usteps(pa.axis_ustep[3]),microstep_usteps(pa.axis_ustep[4]));
+	usb_printf("; Motor Microstepping (1,2,4,8,16), 1/4 steps above (R) 1/16 steps per second: \r\n");
+	usb_printf("M350 X%d Y%d Z%d E%d B%d R%d \r\n",microstep_usteps(pa.axis_ustep[0]),microstep_usteps(pa.axis_ustep[1]),microstep_usteps(pa.axis_ustep[2]),microstep_usteps(pa.axis_ustep[3]),microstep_usteps(pa.axis_ustep[4]),pa.ustep_switch_rate);
+	usb_printf("; Motor Current (I)dle %%, (A)cceleration %%, idle after (S)econds:\r\nM909 I%d A%d S%d \r\n",pa.motor_idle_current,pa.motor_boost_current,pa.motor_idle_time);
 	
 }
 
@@ -337,9 +352,11 @@ void FLASH_Store_to_SD(void)
 	sprintf(c_string,"M510 X%d Y%d Z%d E%d\r",pa.invert_x_dir,pa.invert_y_dir,pa.invert_z_dir,pa.invert_e_dir);
 	sdcard_writeline(c_string);
 	
-	sprintf(c_string,"M301 T0 P%d I%d D%d\r",(int)pa.heater_pTerm[0],(int)pa.heater_iTerm[0],(int)pa.heater_dTerm[0]);
+	sprintf(c_string,"M301 T0 P%d I%d D%d F%d\r",(int)pa.heater_pTerm[0],(int)pa.heater_iTerm[0],(int)pa.heater_dTerm[0],(int)pa.heater_ff_gain[0]);
+	sdcard_writeline(c_string);
+	sprintf(c_string,"M301 T1 P%d I%d D%d F%d\r",(int)pa.heater_pTerm[1],(int)pa.heater_iTerm[1],(int)pa.heater_dTerm[1],(int)pa.heater_ff_gain[1]);
 	sdcard_writeline(c_string);
-	sprintf(c_string,"M301 T1 P%d I%d D%d\r",(int)pa.heater_pTerm[1],(int)pa.heater_iTerm[1],(int)pa.heater_dTerm[1]);
+	sprintf(c_string,"M304 P%d I%d D%d\r",(int)pa.bed_pTerm,(int)pa.bed_iTerm,(int)pa.bed_dTerm);
 	sdcard_writeline(c_string);
 	
 	sprintf(c_string,"M530 T0 E%d\r",pa.heater_thermistor_type[0]);
@@ -359,14 +376,16 @@ void FLASH_Store_to_SD(void)
 	sprintf(c_string,"M301 T1 W%d\r",pa.heater_max_pwm[1]);
 	sdcard_writeline(c_string);
 	
-	sprintf(c_string,"M301 T0 S%d I%d\r",pa.heater_slope[0],pa.heater_intercept[0]);
+	sprintf(c_string,"M301 T0 S%d B%d\r",pa.heater_slope[0],pa.heater_intercept[0]);
 	sdcard_writeline(c_string);
-	sprintf(c_string,"M301 T1 S%d I%d\r",pa.heater_slope[1],pa.heater_intercept[1]);
+	sprintf(c_string,"M301 T1 S%d B%d\r",pa.heater_slope[1],pa.heater_intercept[1]);
 	sdcard_writeline(c_string);
 	
 	sprintf(c_string,"M906 X%d Y%d Z%d E%d B%d\r",count_ma(pa.axis_current[0]),count_ma(pa.axis_current[1]),count_ma(pa.axis_current[2]),count_ma(pa.axis_current[3]),count_ma(pa.axis_current[4]));
 	sdcard_writeline(c_string);
-	sprintf(c_string,"M350 X%d Y%d Z%d E%d B%d\r",microstep_usteps(pa.axis_ustep[0]),microstep_usteps(pa.axis_ustep[1]),microstep_usteps(pa.axis_ustep[2]),microstep_usteps(pa.axis_ustep[3]),microstep_usteps(pa.axis_ustep[4]));
+	sprintf(c_string,"M350 X%d Y%d Z%d E%d B%d R%d\r",microstep_usteps(pa.axis_ustep[0]),microstep_usteps(pa.axis_ustep[1]),microstep_usteps(pa.axis_ustep[2]),microstep_usteps(pa.axis_ustep[3]),microstep_usteps(pa.axis_ustep[4]),pa.ustep_switch_rate);
+	sdcard_writeline(c_string);
+	sprintf(c_string,"M909 I%d A%d S%d\r",pa.motor_idle_current,pa.motor_boost_current,pa.motor_idle_time);
 	sdcard_writeline(c_string);
 	
 
@@ -440,49 +459,21 @@ void FLASH_LoadSettings(void)
 
 
 
-#define CRC16POLY 0x8408
 /*
-//                                      16   12   5
-// this is the CCITT CRC 16 polynomial X  + X  + X  + 1.
-// This works out to be 0x1021, but the way the algorithm works
-// lets us use 0x8408 (the reverse of the bit pattern).  The high
-// bit is always assumed to be set, thus we only use 16 bits to
-// represent the 17 bit value.
+// CRC over the parameter struct, see crc16() in util.c.
+// The checksum field itself is skipped, the result is stored byte swapped.
 */
 unsigned short calc_crc16(void)
 {
 	unsigned short pa_size = 0;
-	unsigned char  *pa_ptr;
-
-	unsigned char  cnt_c;
-	unsigned short data;
-	unsigned short crc = 0xffff;
+	unsigned short crc;
 	
 	pa_size = sizeof(pa) - 2;	//skip 2 byte chksum + 131 byte parameter
 	
 	printf("sizeof pa struct:%d \n\r", pa_size);	//result 131 --> ??? 134
 	
-	pa_ptr = (unsigned char*)&pa;
-	
-	pa_ptr+=2; //skip checksum space
-
-	if (pa_size == 0)
-		return (~crc);
-
-	do
-	{
-		for (cnt_c=0, data=(unsigned int)0xff & *pa_ptr++;cnt_c < 8;cnt_c++, data >>= 1)
-		{
-			if ((crc & 0x0001) ^ (data & 0x0001))
-				crc = (crc >> 1) ^ CRC16POLY;
-			else  
-				crc >>= 1;
-		}	
-	} while (--pa_size);
-
-	crc = ~crc;
-	data = crc;
-	crc = (crc << 8) | (data >> 8 & 0xff);
+	crc = crc16((unsigned char*)&pa + 2, pa_size);
+	crc = (crc << 8) | (crc >> 8 & 0xff);
 	
 	printf("CRC16: 0x%04X \n\r", crc);
 	
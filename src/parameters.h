@@ -18,7 +18,7 @@
  #define NUM_AXIS 4
  #define MAX_EXTRUDER 2
  
- #define FLASH_VERSION "F02" 
+ #define FLASH_VERSION "F06" 
   
  
  typedef struct {
@@ -82,6 +82,10 @@
 	//Motor Settings
 	unsigned char axis_current[5];
 	unsigned char axis_ustep[5];
+	unsigned char motor_idle_current;		//percent of axis_current
+	unsigned char motor_boost_current;		//percent of axis_current while accelerating
+	unsigned short motor_idle_time;			//seconds, 0 = never
+	unsigned short ustep_switch_rate;		//1/16 steps per second above which 1/4 steps are used, 0 = never
 	
 	//Heater Sensor Settings
 	unsigned char heater_thermistor_type[MAX_EXTRUDER];
@@ -94,10 +98,16 @@
 	signed short heater_pTerm[MAX_EXTRUDER];
 	signed short heater_iTerm[MAX_EXTRUDER];
 	signed short heater_dTerm[MAX_EXTRUDER];
+	signed short heater_ff_gain[MAX_EXTRUDER];
 	
 	signed short heater_slope[MAX_EXTRUDER]; 
 	signed short heater_intercept[MAX_EXTRUDER];
 	signed short heater_max_pwm[MAX_EXTRUDER];
+	
+	//Heatbed PID Gain values
+	signed short bed_pTerm;
+	signed short bed_iTerm;
+	signed short bed_dTerm;
  
 } parameter_struct;
 
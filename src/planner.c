@@ -36,6 +36,7 @@
 #include "stepper_control.h"
 #include "motoropts.h"
 #include "globals.h"
+#include "scheduler.h"
 
 
 float destination[NUM_AXIS] = {0.0, 0.0, 0.0, 0.0};
@@ -192,6 +193,8 @@ void prepare_arc_move(char isclockwise)
 
 void kill(char debug)
 {
+	PID_autotune_cancel();
+	Heater_Eval_cancel();
 	heaters[0].target_temp = 0;
 	heaters[1].target_temp = 0;
 	heater_switch(1, 0);	//Heater 0
@@ -674,11 +677,37 @@ unsigned char blocks_queued()
 	}
 }
 
+// Filament step rate in steps/s at nominal speed of the block being executed
+// and the next lookahead blocks of the extruder, the highest one is returned.
+// Moves of E only (retracts) do not melt filament and are skipped.
+unsigned long plan_e_step_rate(unsigned char extruder, unsigned char lookahead)
+{
+	unsigned char block_index = block_buffer_tail;
+	unsigned char head = block_buffer_head;
+	unsigned long rate = 0;
+	unsigned char cnt = 0;
+
+	while(block_index != head && cnt++ <= lookahead)
+	{
+		block_t *block = &block_buffer[block_index];
+
+		if(block->active_extruder == extruder && block->steps_e > 0 && block->step_event_count > 0
+			&& (block->steps_x != 0 || block->steps_y != 0 || block->steps_z != 0))
+		{
+			unsigned long e_rate = (unsigned long)(((float)block->nominal_rate * block->steps_e) / block->step_event_count);
+			rate = max(rate, e_rate);
+		}
+		block_index = next_block_index(block_index);
+	}
+	return rate;
+}
+
 // Block until all buffered steps are executed
 void st_synchronize()
 {
 	while(blocks_queued()) 
 	{
+		scheduler_run();
 		manage_inactivity(1);
 	}   
 }
@@ -732,7 +761,7 @@ void plan_buffer_line(float x, float y, float z, float e, float feed_rate, unsig
 	// Rest here until there is room in the buffer.
 	while(block_buffer_tail == next_buffer_head)
 	{ 
-		//manage_heater(); 
+		scheduler_run();
 		manage_inactivity(1); 
 	}
     
@@ -109,6 +109,8 @@ void st_set_position(long x, long y, long z, long e);
 void st_synchronize();
 void plan_discard_current_block();
 block_t *plan_get_current_block();
+unsigned char blocks_queued();
+unsigned long plan_e_step_rate(unsigned char extruder, unsigned char lookahead);
 
 
 extern char axis_relative_modes[];
@@ -43,7 +43,9 @@
 #include <pio/pio.h>
 #include <irq/irq.h>
 #include <adc/adc12.h>
+#include <tc/tc.h>
 #include <stdio.h>
+#include "util.h"
 
 //------------------------------------------------------------------------------
 //         Local definitions
@@ -52,6 +54,18 @@
 #define BOARD_ADC_FREQ 6000000
 #define ADC_VREF       3300  // 3.3 * 1000
 
+// TC1 triggers one conversion of all enabled channels ADC_TRIGGER_FREQ times
+// a second, the PDC collects ADC_OVERSAMPLE sequences per buffer (25ms).
+#define ADC_TRIGGER_FREQ 1280
+#ifndef ADC_OVERSAMPLE
+#define ADC_OVERSAMPLE   32   // 16..64
+#endif
+#define ADC_CHANNELS     4    // enabled channels, see enchan
+#define ADC_IIR_SHIFT    2    // smoothing of the buffer averages, 1/4 per buffer
+
+// the ADC12B has a PDC, but AT91S_ADC12B does not list its registers
+#define AT91C_BASE_PDC_ADC12B ((AT91PS_PDC)0x400A8100)
+
 
 //------------------------------------------------------------------------------
 //         Local variables
@@ -87,6 +101,12 @@ static const Pin pinsADC[] = {PINS_ADC};
 volatile unsigned int advalue[7];
 static unsigned int chns[] = {ADC_NUM_1, ADC_NUM_2, ADC_NUM_3, ADC_NUM_4, ADC_NUM_5, ADC_NUM_6, ADC_NUM_7};
 static volatile int enchan=(1<<ADC_NUM_3)|(1<<ADC_NUM_5)|(1<<ADC_NUM_1)|(1<<ADC_NUM_2);//|(1<<ADC_NUM_4);//|(1<<ADC_NUM_6)|(1<<ADC_NUM_7);
+
+// PDC ping-pong buffers, each sequence holds the enabled channels in ascending order
+static unsigned short adcbuf[2][ADC_OVERSAMPLE * ADC_CHANNELS];
+static unsigned char adcbuf_next = 0;	// buffer queued in RNPR, the other one is filling
+static unsigned int filtered[7];		// IIR output per channel in 1/16 LSB
+static unsigned char filter_valid = 0;
 unsigned int adc_read(unsigned char channel){
 	if(channel>7) return 0;
 	if(channel==0) return 0;
@@ -107,51 +127,103 @@ void adc_en(unsigned char channel){
 
 //-----------------------------------------------------------------------------
 /// Convert a digital value in milivolt
-/// \param valueToconvert Value to convert in milivolt
+/// \param valueToconvert Value to convert in 1/16 LSB
 //-----------------------------------------------------------------------------
 static unsigned int ConvHex2mV( unsigned int valueToConvert )
 {
     unsigned int mask;
 
-    mask = 0xFFF;
+    mask = 0xFFF << 4;
     
-    return( (ADC_VREF * valueToConvert)/mask);
+    return( (ADC_VREF * valueToConvert + mask/2)/mask);
 }
 
+static inline unsigned int median3(unsigned int a, unsigned int b, unsigned int c)
+{
+    if (a > b) { unsigned int t = a; a = b; b = t; }
+    if (b > c) b = c;
+    return (a > b) ? a : b;
+}
 
 //------------------------------------------------------------------------------
-/// Interrupt handler for the ADC. Signals that the conversion is finished by
-/// setting a flag variable.
+/// Average of one channel over a full buffer in 1/16 LSB, every sample is
+/// replaced by the median of itself and its neighbours first to drop spikes.
 //------------------------------------------------------------------------------
-volatile int conversionDone=0;
-unsigned volatile int status, i;
-volatile int autosample=0;
-
-void adc_sample(){
-    if(conversionDone == enchan){
-	    conversionDone=0;
-	    ADC12_StartConversion(AT91C_BASE_ADC);
-	}
-}
+static unsigned int adc_filter_buffer(const unsigned short* buf, int slot)
+{
+    const unsigned short* s = buf + slot;
+    unsigned int sum = 0;
+    int k;
 
+    for (k = 1; k < ADC_OVERSAMPLE - 1; k++)
+        sum += median3(s[(k-1)*ADC_CHANNELS], s[k*ADC_CHANNELS], s[(k+1)*ADC_CHANNELS]) & 0xFFF;
 
+    return (sum * 16 + (ADC_OVERSAMPLE - 2) / 2) / (ADC_OVERSAMPLE - 2);
+}
 
-void ADCC0_IrqHandler(void)
+//------------------------------------------------------------------------------
+/// Points the PDC at both buffers from the start and enables the transfer.
+//------------------------------------------------------------------------------
+static void adc_pdc_start(void)
 {
-    status = ADC12_GetStatus(AT91C_BASE_ADC);
-    
-    for(i=0;i<7;i++) {
+	AT91C_BASE_PDC_ADC12B->PDC_PTCR = AT91C_PDC_RXTDIS;
+	AT91C_BASE_PDC_ADC12B->PDC_RPR = (unsigned int)adcbuf[0];
+	AT91C_BASE_PDC_ADC12B->PDC_RCR = ADC_OVERSAMPLE * ADC_CHANNELS;
+	AT91C_BASE_PDC_ADC12B->PDC_RNPR = (unsigned int)adcbuf[1];
+	AT91C_BASE_PDC_ADC12B->PDC_RNCR = ADC_OVERSAMPLE * ADC_CHANNELS;
+	adcbuf_next = 1;
+	AT91C_BASE_PDC_ADC12B->PDC_PTCR = AT91C_PDC_RXTEN;
+}
 
-      if ((enchan&(1<<chns[i]) )&&ADC12_IsChannelInterruptStatusSet(status, chns[i])) {
-            advalue[i] = ConvHex2mV(ADC12_GetConvertedData(AT91C_BASE_ADC, chns[i]));
-            conversionDone |= 1<<chns[i];
-        }
+//------------------------------------------------------------------------------
+/// Filters buffers the PDC has finished and converts them to millivolt.
+/// Runs from the main loop, the conversions and transfers need no CPU at all.
+//------------------------------------------------------------------------------
+void adc_sample(){
+    AT91PS_PDC pdc = AT91C_BASE_PDC_ADC12B;
+    const unsigned short* done;
+    int i, slot;
+
+    // the queued buffer moves to RPR when the current one is full
+    if (pdc->PDC_RNCR != 0)
+        return;
+
+    if (pdc->PDC_RCR == 0)
+    {
+        // the main loop was too slow for both buffers. Results kept coming
+        // with nowhere to go, so buffer slot 0 no longer lines up with the
+        // first channel. Stop the trigger, let the running sequence finish
+        // (a few us, 2ms tick is the shortest safe wait) and start clean.
+        TC_Stop(AT91C_BASE_TC1);
+        delay_ms(2);
+        pdc->PDC_PTCR = AT91C_PDC_RXTDIS;
+        (void)AT91C_BASE_ADC->ADC12B_LCDR;	// clears DRDY
+        adc_pdc_start();
+        TC_Start(AT91C_BASE_TC1);
+        return;
     }
 
-	if(autosample)
-        adc_sample();
+    done = adcbuf[adcbuf_next ^ 1];
+    pdc->PDC_RNPR = (unsigned int)done;
+    pdc->PDC_RNCR = ADC_OVERSAMPLE * ADC_CHANNELS;
+    adcbuf_next ^= 1;
+
+    for (i = 0, slot = 0; i < 7; i++) {
+        unsigned int value;
+
+        if (!(enchan&(1<<chns[i])))
+            continue;
+
+        value = adc_filter_buffer(done, slot++);
+        if (filter_valid)
+            filtered[i] += ((int)value - (int)filtered[i]) >> ADC_IIR_SHIFT;
+        else
+            filtered[i] = value;
+        advalue[i] = ConvHex2mV(filtered[i]);
+    }
+    filter_valid = 1;
 }
- 
+
 
 //------------------------------------------------------------------------------
 //         Global functions
@@ -161,25 +233,19 @@ void ADCC0_IrqHandler(void)
 /// Performs measurements on ADC channel 0 and displays the result on the DBGU.
 //------------------------------------------------------------------------------
 
-#ifndef ADCC0_IRQ_PRIORITY
-#define ADCC0_IRQ_PRIORITY 0
-#endif
-
 void initadc(int autos)
 {
    // printf("-- Basic ADC Project %s --\n\r", SOFTPACK_VERSION);
   //  printf("-- %s\n\r", BOARD_NAME);
   //  printf("-- Compiled: %s %s --\n\r", __DATE__, __TIME__);
-  if(autos)
-    autosample=1;
 #ifdef PINS_ADC
     PIO_Configure(pinsADC, PIO_LISTSIZE(pinsADC));
 #endif
 
     ADC12_Initialize( AT91C_BASE_ADC,
                     AT91C_ID_ADC,
-                    AT91C_ADC_TRGEN_DIS,
-                    0,
+                    AT91C_ADC_TRGEN_EN,
+                    AT91C_ADC_TRGSEL_TIOA1,
                     AT91C_ADC_SLEEP_NORMAL_MODE,
                     AT91C_ADC_LOWRES_12_BIT,
                     BOARD_MCK,
@@ -201,24 +267,17 @@ void initadc(int autos)
 //	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_6);
 //	ADC12_EnableChannel(AT91C_BASE_ADC, ADC_NUM_7);
 	
-	IRQ_ConfigureIT(AT91C_ID_ADC, ADCC0_IRQ_PRIORITY, ADCC0_IrqHandler);
-	IRQ_EnableIT(AT91C_ID_ADC);
-	
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_1);
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_2);
-	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_3);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_4);
-    ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_5);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_6);
-//	ADC12_EnableIt(AT91C_BASE_ADC, 1<<ADC_NUM_7);
-	
-/*
-	for(i=0;i<7;i++)
-		if ((1<<chns[i]) & enchan)
-	        	ADC12_EnableIt(AT91C_BASE_ADC, 1<<chns[i]);
-*/
-	    conversionDone=0;
-	    ADC12_StartConversion(AT91C_BASE_ADC);
+	// no interrupts, the PDC moves every result into the buffers
+	filter_valid = 0;
+	adc_pdc_start();
+
+	// TC1 waveform: TIOA1 rises on RC compare and starts a conversion sequence
+	AT91C_BASE_PMC->PMC_PCER = 1 << AT91C_ID_TC1;
+	TC_Configure(AT91C_BASE_TC1, AT91C_TC_CLKS_TIMER_DIV4_CLOCK | AT91C_TC_WAVE
+		| AT91C_TC_WAVESEL_UP_AUTO | AT91C_TC_ACPA_CLEAR | AT91C_TC_ACPC_SET);
+	AT91C_BASE_TC1->TC_RC = (BOARD_MCK / 128) / ADC_TRIGGER_FREQ;
+	AT91C_BASE_TC1->TC_RA = AT91C_BASE_TC1->TC_RC / 2;
+	TC_Start(AT91C_BASE_TC1);
 	//printf("adc init done\n");
     
 }
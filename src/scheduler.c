@@ -0,0 +1,138 @@
+#include <board.h>
+#include <string.h>
+#include "scheduler.h"
+
+extern volatile unsigned long timestamp;
+
+//cycle counter of the data watchpoint and trace unit
+#define DEMCR			(*(volatile unsigned int*)0xE000EDFC)
+#define DEMCR_TRCENA	(1 << 24)
+#define DWT_CTRL		(*(volatile unsigned int*)0xE0001000)
+#define DWT_CYCCNT		(*(volatile unsigned int*)0xE0001004)
+#define DWT_CYCCNTENA	(1 << 0)
+
+static sched_task tasks[SCHED_MAX_TASKS];		//in the order they were added, the index is the id
+static unsigned char order[SCHED_MAX_TASKS];	//ids sorted by priority
+static int task_count = 0;
+
+//cycles of all finished task runs, used to take nested runs out of the outer task
+static unsigned long accounted_cycles = 0;
+
+void scheduler_init(void)
+{
+	memset(tasks,0,sizeof(tasks));
+	task_count = 0;
+
+	DEMCR |= DEMCR_TRCENA;
+	DWT_CYCCNT = 0;
+	DWT_CTRL |= DWT_CYCCNTENA;
+}
+
+//add a task, returns its id
+int scheduler_add(const char* name, void (*run)(void), unsigned char priority, unsigned long period, unsigned long deadline)
+{
+	sched_task* task;
+	int i,pos;
+
+	if (task_count >= SCHED_MAX_TASKS)
+		return -1;
+
+	task = &tasks[task_count];
+	memset(task,0,sizeof(sched_task));
+	task->name = name;
+	task->run = run;
+	task->priority = priority;
+	task->period = period;
+	task->deadline = deadline;
+	task->next_run = timestamp + period;
+
+	//tasks of the same priority run in the order they were added
+	for (pos = 0; pos < task_count && tasks[order[pos]].priority <= priority; pos++)
+		;
+	for (i = task_count; i > pos; i--)
+		order[i] = order[i-1];
+	order[pos] = task_count;
+
+	return task_count++;
+}
+
+static void scheduler_exec(sched_task* task)
+{
+	unsigned long before = accounted_cycles;
+	unsigned long start = DWT_CYCCNT;
+	unsigned long elapsed,self;
+
+	task->running = 1;
+	task->run();
+	task->running = 0;
+
+	elapsed = DWT_CYCCNT - start;
+	self = elapsed - (accounted_cycles - before);
+	accounted_cycles = before + elapsed;
+
+	task->runs++;
+	task->cycles += self;
+	if (self > task->max_cycles)
+		task->max_cycles = self;
+}
+
+//one pass over all tasks, highest priority first. may be called from code that
+//busy-waits inside a task; a task that is already running is skipped then.
+void scheduler_run(void)
+{
+	int i;
+
+	for (i = 0; i < task_count; i++)
+	{
+		sched_task* task = &tasks[order[i]];
+		unsigned long now = timestamp;
+
+		if (task->running)
+			continue;
+
+		if (task->period != SCHED_POLL)
+		{
+			if ((long)(now - task->next_run) < 0)
+				continue;
+
+			if (task->deadline && now - task->next_run > task->deadline)
+				task->late++;
+
+			//keep the period, but do not run missed periods back to back
+			task->next_run += task->period;
+			if ((long)(now - task->next_run) >= 0)
+				task->next_run = now + task->period;
+		}
+
+		scheduler_exec(task);
+	}
+}
+
+int scheduler_task_count(void)
+{
+	return task_count;
+}
+
+//tasks in priority order, for reports
+const sched_task* scheduler_task(int idx)
+{
+	return (idx >= 0 && idx < task_count) ? &tasks[order[idx]] : NULL;
+}
+
+unsigned long scheduler_cycles_to_us(unsigned long long cycles)
+{
+	return (unsigned long)(cycles / (BOARD_MCK / 1000000));
+}
+
+void scheduler_reset_stats(void)
+{
+	int i;
+
+	for (i = 0; i < task_count; i++)
+	{
+		tasks[i].runs = 0;
+		tasks[i].late = 0;
+		tasks[i].cycles = 0;
+		tasks[i].max_cycles = 0;
+	}
+}
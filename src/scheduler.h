@@ -0,0 +1,38 @@
+#ifndef SCHEDULER_H_TQ2XBN7K
+#define SCHEDULER_H_TQ2XBN7K
+
+// Cooperative run-to-completion scheduler for the main loop.
+// Tasks are run in priority order (0 is the highest) on every pass of scheduler_run().
+
+#define SCHED_MAX_TASKS 8
+
+//period of a task that runs on every pass
+#define SCHED_POLL 0
+
+typedef struct
+{
+	const char* name;
+	void (*run)(void);
+	unsigned char priority;
+	unsigned long period;			//ms, or SCHED_POLL
+	unsigned long deadline;			//ms a periodic task may start late, 0 = none
+	unsigned long next_run;
+	unsigned char running;
+
+	//runtime accounting, cycles spent in nested tasks are not counted
+	unsigned long runs;
+	unsigned long late;
+	unsigned long long cycles;
+	unsigned long max_cycles;
+} sched_task;
+
+void scheduler_init(void);
+int scheduler_add(const char* name, void (*run)(void), unsigned char priority, unsigned long period, unsigned long deadline);
+void scheduler_run(void);
+
+int scheduler_task_count(void);
+const sched_task* scheduler_task(int idx);
+unsigned long scheduler_cycles_to_us(unsigned long long cycles);
+void scheduler_reset_stats(void);
+
+#endif /* end of include guard: SCHEDULER_H_TQ2XBN7K */
@@ -1,15 +1,21 @@
 
 #include <board.h>
 #include <memories/MEDSdcard.h>
+#include <memories/sdmmc/sdmmc_mci.h>
 #include <fatfs/src/ff.h>
 #include <stdio.h>
 #include <string.h>
 #include "sdcard.h"
 #include "serial.h"
+#include "util.h"
+#include "scheduler.h"
 
 #define MAX_LUNS            1
 #define DRV_DISK            0
 
+extern volatile unsigned long timestamp;
+DWORD clust2sect(FATFS* fs, DWORD clst);
+
 Media medias[MAX_LUNS];
 
 static unsigned char is_mounted = 0;
@@ -26,6 +32,68 @@ static int fileSeekpos = 0;
 static unsigned char replay_mode = 0;
 static unsigned char replay_pause = 0;
 
+//the replay file is read in chunks into two buffers: the parser takes lines out of the
+//active one while sdcard_prefetch() fills the other. a filled inactive buffer always
+//holds the data that follows the active one.
+#define SD_READ_SIZE 2048	//a multiple of the 512 byte sector
+#define SD_READ_TIMEOUT 1000	//ms for a background read
+#define SD_CLMT_SIZE 64		//cluster map of the replay file, 2 entries per fragment
+
+#define SD_BUF_EMPTY 0
+#define SD_BUF_BUSY 1		//background read running
+#define SD_BUF_FULL 2
+
+static volatile unsigned char readState[2];	//set to SD_BUF_FULL by the MCI interrupt
+static UINT readLen[2];					//end of the data in the buffer
+static UINT readPos[2];					//bytes of the buffer handed out
+static unsigned char readActive = 0;	//buffer the parser reads
+static unsigned char readEnd = 0;		//end of file or read error
+static volatile unsigned char readError = 0;
+static DWORD replayPos = 0;				//file position of the next byte handed out
+
+//background reads go straight to the card with multi block DMA transfers. they need
+//the cluster map of the file and clusters of at least SD_READ_SIZE, else f_read() is used.
+static DWORD replayClmt[SD_CLMT_SIZE];
+static unsigned char readAsync = 0;
+static DWORD readChunk = 0;				//file position of the next background read
+static unsigned long readStart = 0;		//time the running background read was started
+static unsigned char readWaiting = 0;	//sdcard_readwait() runs the other tasks
+
+//captured lines are collected and written with one f_write() up to the next SD_WRITE_SIZE
+//boundary of the file, so FatFs writes whole sectors straight from the buffer
+#define SD_WRITE_SIZE 4096		//a multiple of the 512 byte sector
+#define SD_CAPTURE_SYNC 2000	//ms without new lines before the buffer is written and synced
+
+//replay reads and capture/upload writes share the memory. a capture during a replay
+//(M28, M500 to the card) writes straight to the file instead, see sdcard_writedata()
+static union
+{
+	unsigned char read[2][SD_READ_SIZE];
+	unsigned char write[SD_WRITE_SIZE];
+} sdBuffer __attribute__((aligned(4)));
+static UINT writeLen = 0;
+static UINT writeLimit = SD_WRITE_SIZE;	//bytes to the next boundary
+static unsigned long writeLast = 0;		//time of the last line
+static unsigned long captureStart = 0;
+
+//raw upload (M560): frames of uint16 length (1..SD_UPLOAD_FRAME), payload, crc16 of the
+//payload, all little endian. the payload goes through the capture write buffer.
+#define SD_UPLOAD_FRAME 512
+#define SD_UPLOAD_TIMEOUT 5000	//ms without data before an upload is given up
+#define SD_UPLOAD_DRAIN 500		//ms of silence that ends a failed upload
+
+#define UPLOAD_IDLE 0
+#define UPLOAD_DATA 1
+#define UPLOAD_DRAIN 2			//failed, received data is dropped until the host stops sending
+
+static unsigned char upload_mode = UPLOAD_IDLE;
+static unsigned char uploadFrame[SD_UPLOAD_FRAME + 4];
+static UINT uploadFill = 0;
+static DWORD uploadSize = 0;
+static DWORD uploadDone = 0;
+static unsigned int uploadFrames = 0;
+static unsigned long uploadLast = 0;	//time data was last received
+
 #define _ERR(x) #x
 static const char* errorStrings[] = {
 	_ERR(FR_OK),			/* 0 */
@@ -73,28 +141,239 @@ unsigned char sdcard_iscapturing()
 	return capture_mode;
 }
 
-int sdcard_getchar(unsigned char* chr)
+//a failed transfer does not always end in the callback and leaves the MCI command
+//pending. reset the MCI and the card, the files open on the old mount are invalid.
+static void sdcard_readabort()
 {
-	FRESULT res;
-	UINT read;
+	readError = 1;
+	readState[0] = SD_BUF_EMPTY;
+	readState[1] = SD_BUF_EMPTY;
+
+	is_mounted = 0;
+	if (!MEDSdcard_Initialize(&medias[DRV_DISK],0))
+	{
+		printf("sdcard_readabort: SD card initialization failed\n\r");
+		return;
+	}
+	f_mount(0,&fs);
+	is_mounted = 1;
+}
 
-	if (!replay_mode && !replay_pause)
+//give up a background read that is not done after SD_READ_TIMEOUT.
+//returns 1 while it is still running.
+static unsigned char sdcard_readbusy()
+{
+	if (readState[0] != SD_BUF_BUSY && readState[1] != SD_BUF_BUSY)
 		return 0;
-	
-	res = f_read(&replayFile,chr,1,&read);
-	if (res != FR_OK)
+
+	if (timestamp - readStart > SD_READ_TIMEOUT)
 	{
-		printf("sdcard_getchar: error %s\n\r",getError(res));
+		printf("sdcard_readbusy: timeout\n\r");
+		sdcard_readabort();
 		return 0;
 	}
+	return 1;
+}
+
+//wait for a running background read, before the card is used otherwise. the other
+//tasks keep running meanwhile, the sd card ones stay away from the card.
+static void sdcard_readwait()
+{
+	unsigned char outer = readWaiting;
+
+	readWaiting = 1;
+	while (sdcard_readbusy())
+		scheduler_run();
+	readWaiting = outer;
+}
+
+static void sdcard_readreset()
+{
+	sdcard_readwait();
+	readState[0] = SD_BUF_EMPTY;
+	readState[1] = SD_BUF_EMPTY;
+	readActive = 0;
+	readEnd = 0;
+	readError = 0;
+	replayPos = f_tell(&replayFile);
+	readChunk = replayPos;
+}
+
+//build the cluster map of the replay file for the background reads
+static void sdcard_readsetup()
+{
+	readAsync = 0;
+	if (fs.csize * 512 < SD_READ_SIZE || medias[DRV_DISK].blockSize != 512)
+		return;
+
+	replayClmt[0] = SD_CLMT_SIZE;
+	replayFile.cltbl = replayClmt;
+	if (f_lseek(&replayFile,CREATE_LINKMAP) != FR_OK)
+	{
+		printf("sdcard_readsetup: file too fragmented, no background reads\n\r");
+		replayFile.cltbl = NULL;
+		return;
+	}
+	readAsync = 1;
+}
+
+//card block of a file position, from the cluster map
+static DWORD sdcard_filesector(DWORD ofs)
+{
+	DWORD cl = ofs / 512 / fs.csize;
+	DWORD ncl;
+	DWORD *tbl = replayClmt + 1;
 
-	if (read != 1)
+	for (;;)
 	{
-		printf("sdcard_getchar: end of file\n\r");
-		return 0;
-	}	
+		ncl = *tbl++;
+		if (!ncl)
+			return 0;
+		if (cl < ncl)
+			break;
+		cl -= ncl;
+		tbl++;
+	}
+	return clust2sect(&fs,cl + *tbl) + ((ofs / 512) & (fs.csize - 1));
+}
 
-	return 1;
+//called from the MCI interrupt when a background read is done
+static void sdcard_readdone(unsigned char status, void *pCommand)
+{
+	unsigned char idx = (unsigned char)(unsigned int)((SdCmd*)pCommand)->pArg;
+
+	if (status)
+	{
+		readError = 1;
+		readState[idx] = SD_BUF_EMPTY;
+	}
+	else
+		readState[idx] = SD_BUF_FULL;
+}
+
+//start the background read of the SD_READ_SIZE chunk holding readChunk. the chunk is
+//inside one cluster, so it is one multi block read that continues the previous one.
+static void sdcard_readstart(unsigned char idx)
+{
+	DWORD chunk = readChunk - readChunk % SD_READ_SIZE;
+	DWORD sector;
+
+	if (readChunk >= f_size(&replayFile))
+	{
+		readEnd = 1;
+		return;
+	}
+
+	sector = sdcard_filesector(chunk);
+	if (!sector)
+	{
+		printf("sdcard_readstart: position %u not in the cluster map\n\r",(unsigned int)chunk);
+		readError = 1;
+		return;
+	}
+
+	readPos[idx] = readChunk - chunk;
+	readLen[idx] = (f_size(&replayFile) - chunk < SD_READ_SIZE) ? f_size(&replayFile) - chunk : SD_READ_SIZE;
+	readState[idx] = SD_BUF_BUSY;
+	readStart = timestamp;
+	if (SD_Read((SdCard*)medias[DRV_DISK].interface,sector,sdBuffer.read[idx],SD_READ_SIZE / 512,sdcard_readdone,(void*)(unsigned int)idx))
+	{
+		//the card is still busy, try again on the next pass
+		readState[idx] = SD_BUF_EMPTY;
+		return;
+	}
+	readChunk = chunk + SD_READ_SIZE;
+}
+
+//read the next chunk with f_read(), up to the next SD_READ_SIZE boundary so the reads stay sector aligned
+static void sdcard_readfill(unsigned char idx)
+{
+	FRESULT res;
+
+	res = f_read(&replayFile,sdBuffer.read[idx],SD_READ_SIZE - (f_tell(&replayFile) % SD_READ_SIZE),&readLen[idx]);
+	if (res != FR_OK)
+	{
+		printf("sdcard_readfill: error %s\n\r",getError(res));
+		readError = 1;
+		return;
+	}
+
+	if (readLen[idx] == 0)
+	{
+		printf("sdcard_readfill: end of file\n\r");
+		readEnd = 1;
+		return;
+	}
+	readPos[idx] = 0;
+	readState[idx] = SD_BUF_FULL;
+}
+
+//main loop task: fill the empty buffers while the parser works on the active one
+void sdcard_prefetch()
+{
+	unsigned char idx;
+
+	if (!replay_mode || readEnd || readWaiting)
+		return;
+
+	if (sdcard_readbusy())
+		return;
+
+	if (readError)
+	{
+		printf("sdcard_prefetch: read error\n\r");
+		readEnd = 1;
+		return;
+	}
+
+	if (readState[readActive] == SD_BUF_EMPTY)
+		idx = readActive;
+	else if (readState[readActive ^ 1] == SD_BUF_EMPTY)
+		idx = readActive ^ 1;
+	else
+		return;
+
+	if (readAsync)
+		sdcard_readstart(idx);
+	else
+		sdcard_readfill(idx);
+}
+
+//returns the number of bytes that can be read at *data, 0 while the next chunk is
+//still on its way (with wait set only after a timeout), -1 at the end of the file
+//and -2 after a read error
+int sdcard_peek(const unsigned char** data, unsigned char wait)
+{
+	if (!replay_mode)
+		return -1;
+
+	if (readState[readActive] != SD_BUF_FULL)
+	{
+		sdcard_prefetch();
+		if (wait)
+			sdcard_readwait();
+		if (readState[readActive] != SD_BUF_FULL)
+		{
+			if (readError)
+				return -2;
+			return readEnd ? -1 : 0;
+		}
+	}
+
+	*data = &sdBuffer.read[readActive][readPos[readActive]];
+	return readLen[readActive] - readPos[readActive];
+}
+
+//mark count bytes returned by sdcard_peek() as read
+void sdcard_skip(unsigned int count)
+{
+	readPos[readActive] += count;
+	replayPos += count;
+	if (readPos[readActive] >= readLen[readActive])
+	{
+		readState[readActive] = SD_BUF_EMPTY;
+		readActive ^= 1;
+	}
 }
 
 void sdcard_replaystart()
@@ -122,6 +401,8 @@ void sdcard_replaystart()
 			return;
 		}
 		usb_printf("File opened: %s \n\rok\n\r",selectedFile);
+		sdcard_readsetup();
+		sdcard_readreset();
 	}
 	replay_mode = 1;
 	replay_pause = 0;
@@ -144,8 +425,13 @@ void sdcard_replaystop()
 	if (!replay_mode)
 		return;
 		
+	sdcard_readwait();
 	f_close(&replayFile);
 	replay_mode = 0;
+	readState[0] = SD_BUF_EMPTY;
+	readState[1] = SD_BUF_EMPTY;
+	readEnd = 0;
+	replayPos = 0;
 }
 
 int sdcard_isreplaying()
@@ -173,6 +459,7 @@ void sdcard_capturestart(const char* name)
 	if (capture_mode)
 		sdcard_capturestop();
 		
+	sdcard_readwait();
 	printf("sdcard_capturestart: opening file %s for capture\n\r",selectedFile);
 	FRESULT res = f_open(&captureFile,selectedFile,FA_CREATE_ALWAYS|FA_WRITE|FA_READ);
 
@@ -184,19 +471,89 @@ void sdcard_capturestart(const char* name)
 	}
 
 	capture_mode = 1;
+	writeLen = 0;
+	writeLimit = SD_WRITE_SIZE;
+	captureStart = timestamp;
+	writeLast = timestamp;
 }
 
 void sdcard_setposition(unsigned int filepos)
 {
 	if (replay_mode)
+	{
+		sdcard_readwait();
 		f_lseek(&replayFile,filepos);
+		sdcard_readreset();
+	}
 	else
 		fileSeekpos = filepos;
 }
 
 
+//write out the collected lines
+static unsigned char sdcard_filewrite(const void* data, UINT len)
+{
+	FRESULT res;
+	UINT written;
+
+	sdcard_readwait();
+	res = f_write(&captureFile,data,len,&written);
+	writeLimit = SD_WRITE_SIZE - (f_tell(&captureFile) % SD_WRITE_SIZE);
+	if (res != FR_OK)
+	{
+		printf("sdcard_filewrite error %s\n\r",getError(res));
+		return 0;
+	}
+
+	if (len != written)
+	{
+		printf("sdcard_filewrite error: disk full?\n\r");
+		return 0;
+	}
+	return 1;
+}
+
+static unsigned char sdcard_writeflush()
+{
+	UINT len = writeLen;
+
+	if (len == 0)
+		return 1;
+
+	writeLen = 0;
+	return sdcard_filewrite(sdBuffer.write,len);
+}
+
+static unsigned char sdcard_writedata(const char* data, UINT len)
+{
+	unsigned char ok = 1;
+
+	//the buffer holds the replay chunks
+	if (replay_mode)
+		return sdcard_filewrite(data,len);
+
+	while (len)
+	{
+		UINT count = writeLimit - writeLen;
+
+		if (count > len)
+			count = len;
+		memcpy(&sdBuffer.write[writeLen],data,count);
+		writeLen += count;
+		data += count;
+		len -= count;
+
+		if (writeLen >= writeLimit && !sdcard_writeflush())
+			ok = 0;
+	}
+	return ok;
+}
+
 void sdcard_capturestop()
 {
+	unsigned long ms;
+	DWORD size;
+
 	printf("sdcard_capturestop\n\r");
 	
 	if (!capture_mode)
@@ -205,36 +562,160 @@ void sdcard_capturestop()
 		return;
 	}
 	
-	usb_printf("%d bytes written\n\r",f_tell(&captureFile));
+	sdcard_readwait();
+	sdcard_writeflush();
 	f_sync(&captureFile);
+	size = f_tell(&captureFile);
 	f_close(&captureFile);
 	capture_mode = 0;
+
+	ms = timestamp - captureStart;
+	usb_printf("%d bytes written in %u ms (%u bytes/s)\n\r",size,(unsigned int)ms,
+		(unsigned int)(ms ? (unsigned long long)size * 1000 / ms : size));
 }
 
 unsigned char sdcard_writeline(const char* line)
 {
-	FRESULT res;
-	UINT written;
-	
+	unsigned char ok;
+
 	if (!capture_mode)
 		return 0;
 		
+	writeLast = timestamp;
+	ok = sdcard_writedata(line,strlen(line));
+	if (!sdcard_writedata("\n",1))
+		ok = 0;
 	
-	res = f_write(&captureFile,line,strlen(line),&written);
+	return ok;
+}
+
+static void sdcard_uploadfinish()
+{
+	unsigned long ms = timestamp - captureStart;
+	unsigned char ok = sdcard_writeflush();
+
+	if (f_close(&captureFile) != FR_OK)
+		ok = 0;
+	upload_mode = UPLOAD_IDLE;
+
+	if (!ok)
+	{
+		usb_printf("error: upload of %s failed writing to the card\r\n",selectedFile);
+		return;
+	}
+	usb_printf("Done uploading %s: %u bytes in %u ms (%u bytes/s)\r\n",selectedFile,(unsigned int)uploadDone,(unsigned int)ms,
+		(unsigned int)(ms ? (unsigned long long)uploadDone * 1000 / ms : uploadDone));
+}
+
+//open the file for a raw upload of size bytes, the frames follow the reply
+void sdcard_uploadstart(const char* name, unsigned int size)
+{
+	FRESULT res;
+
+	if (upload_mode != UPLOAD_IDLE || capture_mode || replay_mode)
+	{
+		usb_printf("error: sd card busy\r\n");
+		return;
+	}
+
+	strcpy(selectedfileBuffer,name);
+	selectedFile = selectedfileBuffer;
+	printf("sdcard_uploadstart: opening file %s for %u bytes\n\r",selectedFile,size);
+
+	res = f_open(&captureFile,selectedFile,FA_CREATE_ALWAYS|FA_WRITE);
 	if (res != FR_OK)
 	{
-		printf("sdcard_writeline error %s\n\r",getError(res));
-		return 0;
+		printf("sdcard_uploadstart: failed to open file, error: %s\n\r",getError(res));
+		usb_printf("error: failed to open file\r\n");
+		return;
 	}
 
-	if (strlen(line) != written)
+	writeLen = 0;
+	writeLimit = SD_WRITE_SIZE;
+	uploadFill = 0;
+	uploadSize = size;
+	uploadDone = 0;
+	uploadFrames = 0;
+	captureStart = timestamp;
+	uploadLast = timestamp;
+	upload_mode = UPLOAD_DATA;
+	usb_printf("ok upload %u bytes\r\n",size);
+
+	if (size == 0)
+		sdcard_uploadfinish();
+}
+
+//drop the partial file, the rest of the transfer is discarded
+static void sdcard_uploadfail(const char* reason)
+{
+	writeLen = 0;
+	f_close(&captureFile);
+	f_unlink(selectedFile);
+	upload_mode = UPLOAD_DRAIN;
+	usb_printf("error: upload failed in frame %u: %s\r\n",uploadFrames,reason);
+}
+
+unsigned char sdcard_isuploading()
+{
+	return upload_mode != UPLOAD_IDLE;
+}
+
+//received data during an upload, returns the number of bytes consumed
+unsigned int sdcard_uploadfeed(const unsigned char* data, unsigned int len)
+{
+	unsigned int count = 0;
+
+	uploadLast = timestamp;
+	if (upload_mode == UPLOAD_DRAIN)
+		return len;
+
+	while (count < len && upload_mode == UPLOAD_DATA)
 	{
-		printf("sdcard_writeline error: disk full?\n\r");
-		return 0;
+		UINT frameLen = SD_UPLOAD_FRAME;
+		UINT need, take;
+
+		if (uploadFill >= 2)
+			frameLen = uploadFrame[0] | (uploadFrame[1] << 8);
+		need = (uploadFill < 2) ? 2 - uploadFill : frameLen + 4 - uploadFill;
+		take = (len - count < need) ? len - count : need;
+		memcpy(&uploadFrame[uploadFill],data + count,take);
+		uploadFill += take;
+		count += take;
+
+		if (uploadFill == 2)
+		{
+			frameLen = uploadFrame[0] | (uploadFrame[1] << 8);
+			if (frameLen == 0 || frameLen > SD_UPLOAD_FRAME)
+				sdcard_uploadfail("bad length");
+			else if (uploadDone + frameLen > uploadSize)
+				sdcard_uploadfail("more data than announced");
+			continue;
+		}
+
+		if (uploadFill < frameLen + 4)
+			continue;
+
+		uploadFill = 0;
+		if ((unsigned short)(uploadFrame[frameLen + 2] | (uploadFrame[frameLen + 3] << 8)) != crc16(uploadFrame + 2,frameLen))
+		{
+			sdcard_uploadfail("incorrect checksum");
+			break;
+		}
+		if (!sdcard_writedata((const char*)uploadFrame + 2,frameLen))
+		{
+			sdcard_uploadfail("write error");
+			break;
+		}
+		uploadDone += frameLen;
+		uploadFrames++;
+		if (uploadDone == uploadSize)
+			sdcard_uploadfinish();
 	}
-	f_write(&captureFile,"\n",1,&written);
-	
-	return 1;
+
+	//the end of a failed upload is dropped as well
+	if (upload_mode == UPLOAD_DRAIN)
+		return len;
+	return count;
 }
 
 
@@ -242,7 +723,24 @@ unsigned char sdcard_writeline(const char* line)
 
 void sdcard_handle_state()
 {
-	unsigned char has_card = sdcard_carddetected();
+	unsigned char has_card;
+
+	//called from sdcard_readwait() or a read is on its way: the card is left alone
+	if (readWaiting || sdcard_readbusy())
+		return;
+
+	has_card = sdcard_carddetected();
+	if (upload_mode == UPLOAD_DATA && timestamp - uploadLast > SD_UPLOAD_TIMEOUT)
+		sdcard_uploadfail("timeout");
+	else if (upload_mode == UPLOAD_DRAIN && timestamp - uploadLast > SD_UPLOAD_DRAIN)
+		upload_mode = UPLOAD_IDLE;
+
+	//capture went quiet: get the last lines onto the card
+	if (capture_mode && writeLen && timestamp - writeLast > SD_CAPTURE_SYNC)
+	{
+		sdcard_writeflush();
+		f_sync(&captureFile);
+	}
 
 	if (has_card != had_card)
 	{
@@ -275,6 +773,7 @@ void sdcard_mount()
 		printf("\r\nsdcard: SD card initialization failed, no sd card inserted?\r\n");
 		return;
 	}
+	printf("sdcard: %u kHz bus clock\r\n",(unsigned int)(((SdCard*)medias[DRV_DISK].interface)->transSpeed / 1000));
 	
 	f_mount(0,&fs);
 	
@@ -298,6 +797,7 @@ void sdcard_unmount()
 	if (!is_mounted)
 		return;
 		
+	sdcard_readwait();
 	f_mount(0,NULL);
 	is_mounted = 0;
 }
@@ -320,7 +820,7 @@ void sdcard_printstatus()
 	}
 	else
 	{
-		usb_printf("ok %02d%% (%d/%d)\n\r",(int)(f_tell(&replayFile)/(double)f_size(&replayFile)),f_tell(&replayFile),f_size(&replayFile));
+		usb_printf("ok %02d%% (%d/%d)\n\r",(int)(replayPos*100/(double)f_size(&replayFile)),replayPos,f_size(&replayFile));
 	}
 }
 
@@ -340,6 +840,7 @@ void sdcard_listfiles()
 		return;
 	}
 	
+	sdcard_readwait();
 	res = f_opendir(&rootDir,"0:");
 	
 	if (res != FR_OK)
@@ -10,7 +10,12 @@ unsigned char sdcard_iscapturing();
 unsigned char sdcard_writeline(const char* line);
 void sdcard_setposition(unsigned int filepos);
 void sdcard_printstatus();
-int sdcard_getchar(unsigned char* chr);
+int sdcard_peek(const unsigned char** data, unsigned char wait);
+void sdcard_skip(unsigned int count);
+void sdcard_prefetch();
+void sdcard_uploadstart(const char* name, unsigned int size);
+unsigned int sdcard_uploadfeed(const unsigned char* data, unsigned int len);
+unsigned char sdcard_isuploading();
 void sdcard_replaystart();
 void sdcard_replaypause();
 void sdcard_replaystop();
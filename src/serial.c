@@ -41,6 +41,7 @@
 #include <stdarg.h>
 #include "util.h"
 #include "serial.h"
+#include "init_configuration.h"
 
 //------------------------------------------------------------------------------
 //      Definitions
@@ -61,8 +62,19 @@
 unsigned char USBState = STATE_IDLE;
 
 //static unsigned char sendBuffer[DATABUFFERSIZE];
-/// Buffer for storing incoming USB data.
-static unsigned char usbBuffer[DATABUFFERSIZE];
+/// Two buffers for storing incoming USB data, one is always armed for the
+/// next OUT transfer while the other one is handed to the receiver.
+static unsigned char usbBuffer[2][DATABUFFERSIZE];
+/// Bytes of a completed buffer not yet taken by the receiver, 0 = buffer free
+static volatile unsigned int usbBufferLen[2];
+/// Read offset into a completed buffer
+static volatile unsigned int usbBufferPos[2];
+/// Buffer used for the next OUT transfer
+static volatile unsigned char usbFillBuffer = 0;
+/// Buffer to hand to the receiver next
+static volatile unsigned char usbDeliverBuffer = 0;
+/// Set while an OUT transfer is armed
+static volatile unsigned char usbReadArmed = 0;
 unsigned char isSerialConnected = 0;
 //------------------------------------------------------------------------------
 //         VBus monitoring (optional)
@@ -151,38 +163,84 @@ void USBDCallbacks_Suspended(void)
     USBState = STATE_SUSPEND;
 }
 
-static void (*callback)(unsigned char)=0;
+static unsigned int (*callback)(const unsigned char*,unsigned int)=0;
 
-void samserial_setcallback(void (*c)(unsigned char)){
+void samserial_setcallback(unsigned int (*c)(const unsigned char*,unsigned int)){
 	callback=c;
 }
 
+static void UsbDataReceived(unsigned int bufferIdx,
+                            unsigned char status,
+                            unsigned int received,
+                            unsigned int remaining);
+
+//------------------------------------------------------------------------------
+/// Arms the next OUT transfer if no transfer is pending and the buffer next in
+/// line has been consumed. Called from the USB interrupt or with it disabled.
+//------------------------------------------------------------------------------
+static void UsbArmRead(void)
+{
+    if (usbReadArmed || usbBufferLen[usbFillBuffer])
+        return;
+
+    usbReadArmed = 1;
+    if (CDCDSerialDriver_Read(usbBuffer[usbFillBuffer],
+                              DATABUFFERSIZE,
+                              (TransferCallback) UsbDataReceived,
+                              (void *) (unsigned int) usbFillBuffer) != USBD_STATUS_SUCCESS)
+    {
+        usbReadArmed = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+/// Hands completed buffers to the receiver in the order they were filled.
+/// Stops when the receiver does not take all data, the rest stays pending.
+//------------------------------------------------------------------------------
+static void UsbDeliver(void)
+{
+    while (callback && usbBufferLen[usbDeliverBuffer])
+    {
+        unsigned char idx = usbDeliverBuffer;
+        unsigned int taken = callback(&usbBuffer[idx][usbBufferPos[idx]], usbBufferLen[idx]);
+
+        usbBufferPos[idx] += taken;
+        usbBufferLen[idx] -= taken;
+        if (usbBufferLen[idx])
+            break;
+
+        usbDeliverBuffer = idx ^ 1;
+    }
+}
+
 //------------------------------------------------------------------------------
 /// Callback invoked when data has been received on the USB.
+/// The alternate buffer is armed before the received packet is handed to the
+/// receiver, so the endpoint is not idle while the data is copied. If the
+/// receiver is full the data is kept and no further transfer is armed until
+/// samserial_poll() has delivered it, so the host is held off instead of data
+/// being dropped.
 //------------------------------------------------------------------------------
-static void UsbDataReceived(unsigned int unused,
+static void UsbDataReceived(unsigned int bufferIdx,
                             unsigned char status,
                             unsigned int received,
                             unsigned int remaining)
 {
+    usbReadArmed = 0;
+
     // Check that data has been received successfully
     
     if (status == USBD_STATUS_SUCCESS)
     {
-        int i=0;
-        if (callback)
+        if (received)
         {
-            //printf("calling callback\r\n");
-            for(i=0;i<received;++i)
-            {
-                //printf("calling callback with %c\r\n",usbBuffer[i]);
-                callback(usbBuffer[i]);
-            }
-            CDCDSerialDriver_Read(usbBuffer,
-                                  DATABUFFERSIZE,
-                                  (TransferCallback) UsbDataReceived,
-                                  0);
+            usbBufferPos[bufferIdx] = 0;
+            usbBufferLen[bufferIdx] = received;
+            usbFillBuffer = bufferIdx ^ 1;
         }
+        UsbArmRead();
+        UsbDeliver();
+        UsbArmRead();
     }
     else
     {
@@ -191,6 +249,21 @@ static void UsbDataReceived(unsigned int unused,
         //  TRACE_WARNING( "UsbDataReceived: Transfer error\n\r");
     }
 }
+
+//------------------------------------------------------------------------------
+/// Delivers received data held back because the receiver was full and re-arms
+/// the OUT endpoint. Called from the main loop.
+//------------------------------------------------------------------------------
+void samserial_poll(void)
+{
+    if (!isSerialConnected || (usbReadArmed && !usbBufferLen[usbDeliverBuffer]))
+        return;
+
+    IRQ_DisableIT(AT91C_ID_UDPHS);
+    UsbDeliver();
+    UsbArmRead();
+    IRQ_EnableIT(AT91C_ID_UDPHS);
+}
 //volatile int busyflag=0;
 //volatile char _samserial_buffer[128];
 void samserial_print(const char* c)
@@ -198,49 +271,269 @@ void samserial_print(const char* c)
 	usb_printf(c);
 }
 
-volatile char bufferInUse = 0;
-char printBuffer[256];
+//------------------------------------------------------------------------------
+//         Transmit path
+//------------------------------------------------------------------------------
+
+/// Size of the transmit ring
+#define TX_BUFFER_SIZE 2048
+/// Space reserved for formatting one message. Output of vsprintf is limited to
+/// MAX_STRING_SIZE of stdio.c plus the last argument, this leaves enough margin.
+#define TX_LINE_MAX 256
+/// Number of queued reports with the DROP_TELEMETRY policy
+#if USB_TX_FULL_POLICY == USB_TX_COALESCE
+#define TX_REPORT_SLOTS 1
+#else
+#define TX_REPORT_SLOTS 4
+#endif
+
+/// Ring holding formatted replies. Messages are formatted straight into free
+/// space and the unsent part is written out in chained transfers. When the
+/// free space at the end is too small for a message the write position wraps
+/// to the start and txWrap marks where the data before it ends.
+static char txBuffer[TX_BUFFER_SIZE];
+/// Write position, only changed by the main loop
+static volatile unsigned int txHead = 0;
+/// Start of the data not yet sent completely, only changed by the USB interrupt
+static volatile unsigned int txTail = 0;
+/// End of the data before txHead wrapped
+static volatile unsigned int txWrap = 0;
+/// Length of the ring transfer in progress
+static volatile unsigned int txInFlight = 0;
+/// Set while a transfer is in progress
+static volatile unsigned char txBusy = 0;
+/// Set when the last transfer was a report, replies and reports alternate
+static unsigned char txLastWasReport = 0;
+
+/// Reports (temperatures, progress) waiting to be sent. When all slots are
+/// used the oldest report is replaced, they are never waited for.
+typedef struct {
+    unsigned short len;
+    char data[TX_LINE_MAX];
+} TxReport;
+
+static TxReport txReports[TX_REPORT_SLOTS];
+static volatile unsigned char txReportHead = 0;
+static volatile unsigned char txReportCount = 0;
+/// Copy of the report in transfer, so its slot can be reused right away
+static char txReportBuffer[TX_LINE_MAX];
+/// Length of the report in txReportBuffer and the part of it already sent
+static unsigned short txReportLen = 0;
+static unsigned short txReportSent = 0;
+
+/// Messages dropped because the transmit buffer was full
+unsigned int txDropped = 0;
+
+static void UsbWriteCompleted(void* pArg,
+                            unsigned char status,
+                            unsigned int received,
+                            unsigned int remaining);
+
+//------------------------------------------------------------------------------
+/// Starts the next transfer if none is in progress. Must be called from the
+/// USB interrupt or with interrupts disabled.
+//------------------------------------------------------------------------------
+static void UsbTxKick(void)
+{
+    void *pData;
+    unsigned int len;
+
+    if (txBusy)
+        return;
+
+    if (txReportSent < txReportLen)
+    {
+        // the last byte of a report split below
+        len = txReportLen - txReportSent;
+        pData = &txReportBuffer[txReportSent];
+        txReportSent = txReportLen;
+        txInFlight = 0;
+    }
+    else if (txReportCount && (!txLastWasReport || txHead == txTail))
+    {
+        unsigned char slot = (txReportHead + TX_REPORT_SLOTS - txReportCount) % TX_REPORT_SLOTS;
+
+        txReportLen = txReports[slot].len;
+        memcpy(txReportBuffer, txReports[slot].data, txReportLen);
+        txReportCount--;
+        len = txReportLen;
+        if (len && (len & 63) == 0)
+            len--;
+        txReportSent = len;
+        txInFlight = 0;
+        txLastWasReport = 1;
+        pData = txReportBuffer;
+    }
+    else if (txHead != txTail)
+    {
+        len = ((txHead >= txTail) ? txHead : txWrap) - txTail;
+        // a transfer of a multiple of the packet size would need a zero length
+        // packet to complete on the host side, leave the last byte for the next
+        // one (64 is the full speed packet size and divides the high speed one).
+        // Reports are split the same way above.
+        if ((len & 63) == 0)
+            len--;
+
+        txInFlight = len;
+        txLastWasReport = 0;
+        pData = &txBuffer[txTail];
+    }
+    else
+        return;
+
+    txBusy = 1;
+    if (CDCDSerialDriver_Write(pData, len, UsbWriteCompleted, 0) != USBD_STATUS_SUCCESS)
+    {
+        txInFlight = 0;
+        txReportSent = txReportLen;
+        txBusy = 0;
+    }
+}
 
+//------------------------------------------------------------------------------
+/// Callback invoked when a transfer has been sent, chains the next one.
+//------------------------------------------------------------------------------
 static void UsbWriteCompleted(void* pArg,
                             unsigned char status,
                             unsigned int received,
                             unsigned int remaining)
 {
-	bufferInUse = 0;
+    txTail += txInFlight;
+    if (txHead < txTail && txTail == txWrap)
+        txTail = 0;
+
+    txInFlight = 0;
+    txBusy = 0;
+    UsbTxKick();
+}
+
+//------------------------------------------------------------------------------
+/// Returns TX_LINE_MAX contiguous free bytes at the write position of the
+/// ring, wrapping it if needed, or 0 if the ring is full.
+//------------------------------------------------------------------------------
+static char *UsbTxReserve(void)
+{
+    char *pFree = 0;
+    unsigned int state = irq_save();
+
+    // restart at the beginning when everything has been sent
+    if (txHead == txTail)
+        txHead = txTail = 0;
+
+    if (txHead >= txTail)
+    {
+        if (TX_BUFFER_SIZE - txHead >= TX_LINE_MAX)
+            pFree = &txBuffer[txHead];
+        else if (txTail > TX_LINE_MAX)
+        {
+            txWrap = txHead;
+            txHead = 0;
+            pFree = txBuffer;
+        }
+    }
+    else if (txTail - txHead > TX_LINE_MAX)
+        pFree = &txBuffer[txHead];
+
+    irq_restore(state);
+    return pFree;
 }
 
+//------------------------------------------------------------------------------
+/// Returns 0 if nothing can be sent at the moment.
+//------------------------------------------------------------------------------
+static unsigned char UsbTxReady(void)
+{
+    return isSerialConnected && USBState != STATE_SUSPEND;
+}
+
+/// The free space is only waited for outside of interrupt handlers
+#define IN_INTERRUPT() (SCB->ICSR & 0x1FF)
+
+//------------------------------------------------------------------------------
+/// Formats a reply into the transmit ring and starts sending it. Returns
+/// without waiting for the transfer. If the ring is full it waits up to one
+/// second for free space before the message is dropped.
+//------------------------------------------------------------------------------
 void usb_printf(const char * format, ...)
 {
-	if (!isSerialConnected)
+	if (!UsbTxReady())
 		return;
-    
-    if (USBState == STATE_SUSPEND)
-        return;
 	
+	char *pFree;
 	unsigned int timeout=1000;
-	while(bufferInUse && timeout--)
+	while((pFree = UsbTxReserve()) == 0 && timeout-- && !IN_INTERRUPT())
 	{
 		delay_ms(1);
 	}
 	
-	if (bufferInUse)
+	if (pFree == 0)
 	{
+		txDropped++;
 		printf("usb_printf timeout\r\n");
 		return;
 	}
 	
-	unsigned int str_len = 0;
+	int str_len = 0;
 	va_list args;
 	va_start (args, format);
-	str_len = vsprintf (printBuffer,format, args);
+	str_len = vsprintf (pFree,format, args);
 	va_end (args);
 
-	bufferInUse = 1; 
-	if(CDCDSerialDriver_Write((void *)printBuffer,str_len, UsbWriteCompleted, 0)!= USBD_STATUS_SUCCESS)
-	{		
-		printf("USB FAIL\r\n");
-		bufferInUse = 0;
+	// an unsupported conversion gives EOF, nothing is sent then
+	if (str_len < 0)
+	{
+		printf("usb_printf: bad format\r\n");
+		return;
 	}
+
+	unsigned int state = irq_save();
+	txHead += str_len;
+	UsbTxKick();
+	irq_restore(state);
+}
+
+//------------------------------------------------------------------------------
+/// Sends a periodic report (temperatures, progress), which may be dropped or
+/// replaced by a newer one when the host does not keep up, as selected with
+/// USB_TX_FULL_POLICY. Never waits.
+//------------------------------------------------------------------------------
+void usb_report(const char * format, ...)
+{
+	if (!UsbTxReady())
+		return;
+
+	va_list args;
+	va_start (args, format);
+#if USB_TX_FULL_POLICY == USB_TX_BLOCK
+	char line[TX_LINE_MAX];
+	if (vsprintf (line, format, args) >= 0)
+		usb_printf("%s", line);
+#else
+	char line[TX_LINE_MAX];
+	int str_len = vsprintf (line, format, args);
+
+	if (str_len < 0)
+	{
+		va_end (args);
+		printf("usb_report: bad format\r\n");
+		return;
+	}
+
+	unsigned int state = irq_save();
+	if (txReportCount == TX_REPORT_SLOTS)
+	{
+		// replace the oldest report
+		txReportCount--;
+		txDropped++;
+	}
+	txReports[txReportHead].len = str_len;
+	memcpy(txReports[txReportHead].data, line, str_len);
+	txReportHead = (txReportHead + 1) % TX_REPORT_SLOTS;
+	txReportCount++;
+	UsbTxKick();
+	irq_restore(state);
+#endif
+	va_end (args);
 }
 
 
@@ -271,7 +564,7 @@ void samserial_init()
         }
         isSerialConnected = 1;
         // Start receiving data on the USB
-        CDCDSerialDriver_Read(usbBuffer,DATABUFFERSIZE,(TransferCallback) UsbDataReceived,0);
+        UsbArmRead();
        
 }
 
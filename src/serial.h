@@ -1,6 +1,8 @@
 
-void samserial_setcallback(void (*c)(unsigned char));
+void samserial_setcallback(unsigned int (*c)(const unsigned char* data,unsigned int len));
 void samserial_print(const char* c);
 void samserial_init();
+void samserial_poll(void);
 void usb_printf(const char * format, ...);
+void usb_report(const char * format, ...);
 
@@ -88,6 +88,26 @@ volatile long 	counter_x,       		// Counter variables for the bresenham line tr
 				counter_z,       
 				counter_e;
 volatile unsigned long step_events_completed; // The number of step events executed in the current block
+static unsigned char block_axes;		// motors moved by the current block, for the dynamic current
+static unsigned char block_current;		// MOTOR_CURRENT_RUN or MOTOR_CURRENT_BOOST
+static unsigned char step_loops = 1;	// step events per interrupt
+
+// Dynamic microstepping: the planner counts steps of the M350 mode, 1/16 steps when it is
+// used. ustep_pos[] follows them in 1/16 steps, ustep_phys[] is the 1/16 step the driver is on, they differ while the driver runs in 1/4 steps.
+#define USTEP_AXES			3		// X, Y and Z
+#define USTEP_FINE_MODE		3		// microstep_mode(16)
+#define USTEP_COARSE_MODE	2		// microstep_mode(4)
+#define USTEP_COARSE_RATIO	4		// 1/16 steps per 1/4 step
+#define USTEP_FULL_STEP		16		// 1/16 steps per full step
+#define USTEP_PULSE_DELAY	50		// busy loop for the 1us step pulse high and low time
+
+static long ustep_pos[USTEP_AXES];
+static long ustep_phys[USTEP_AXES];
+static unsigned char ustep_want = 0;	// axes the current block runs in 1/4 steps
+static volatile unsigned char ustep_coarse = 0;	// axes the driver is in 1/4 steps
+// 1/16 steps per planner step for each microstep mode (1, 2, 4, 16), so the positions stay
+// in 1/16 steps of the driver after moves with another M350 setting
+static const unsigned char ustep_size[4] = {16, 8, 4, 1};
 
 #ifdef ADVANCE
 	volatile long advance_rate, advance, final_advance = 0;
@@ -208,6 +228,116 @@ void trapezoid_generator_reset()
 
 }
 
+static void ustep_delay(void)
+{
+	volatile int i;
+	for(i = 0; i < USTEP_PULSE_DELAY; i++)
+		;
+}
+
+static void ustep_setdir(unsigned char axis, unsigned char negative)
+{
+	unsigned char invert;
+
+	if(axis == X_AXIS)
+		invert = pa.invert_x_dir;
+	else if(axis == Y_AXIS)
+		invert = pa.invert_y_dir;
+	else
+		invert = pa.invert_z_dir;
+	motor_setdir(axis, negative ? invert : !invert);
+}
+
+// Back to the configured mode. The driver rests on a 1/4 step, which is a valid 1/16 step,
+// so this is allowed at any time. Then catch up the 1/16 steps the driver is behind.
+static void ustep_to_fine(unsigned char axis)
+{
+	long diff = ustep_pos[axis] - ustep_phys[axis];
+
+	motor_setustep(axis, pa.axis_ustep[axis]);
+	ustep_coarse &= ~(1<<axis);
+
+	if(diff != 0)
+	{
+		ustep_setdir(axis, diff < 0);
+		if(diff < 0)
+			diff = -diff;
+		while(diff--)
+		{
+			ustep_delay();
+			motor_step(axis);
+			ustep_delay();
+			motor_unstep();
+		}
+		ustep_delay();
+	}
+	ustep_phys[axis] = ustep_pos[axis];
+}
+
+// Pick the mode of every axis for a new block: 1/4 steps when the axis moves fast enough.
+// Leaving 1/4 steps is done right here, entering them on the next full step of the axis.
+static void ustep_block_start(void)
+{
+	long steps[USTEP_AXES];
+	unsigned char axis;
+
+	steps[X_AXIS] = current_block->steps_x;
+	steps[Y_AXIS] = current_block->steps_y;
+	steps[Z_AXIS] = current_block->steps_z;
+
+	ustep_want = 0;
+	for(axis = 0; axis < USTEP_AXES; axis++)
+	{
+		if(pa.ustep_switch_rate && pa.axis_ustep[axis] == USTEP_FINE_MODE && steps[axis] > 0)
+		{
+			unsigned long rate = (unsigned long)(((unsigned long long)current_block->nominal_rate * steps[axis]) / current_block->step_event_count);
+			unsigned long limit = pa.ustep_switch_rate;
+
+			// some hysteresis, so a print at about the limit does not switch on every block
+			if(ustep_coarse & (1<<axis))
+				limit -= limit / 4;
+			if(rate >= limit)
+				ustep_want |= 1<<axis;
+		}
+		if((ustep_coarse & (1<<axis)) && !(ustep_want & (1<<axis)))
+			ustep_to_fine(axis);
+	}
+}
+
+// Before the microstep mode of X, Y or Z is changed (M350): let the queue run empty and
+// wait for the interrupt to put the drivers back in their configured mode.
+void stepper_ustep_sync(void)
+{
+	st_synchronize();
+	while(ustep_coarse)
+		;
+}
+
+// One planner step of X, Y or Z: pulse the motor when the driver has to follow
+static inline void ustep_step(unsigned char axis, unsigned char negative)
+{
+	long pos = ustep_pos[axis];
+	long size = ustep_size[pa.axis_ustep[axis] & 3];
+
+	// enter 1/4 steps while the driver rests on a full step, the step pin is low here
+	if((ustep_want & ~ustep_coarse & (1<<axis)) && (pos & (USTEP_FULL_STEP-1)) == 0)
+	{
+		motor_setustep(axis, USTEP_COARSE_MODE);
+		ustep_coarse |= 1<<axis;
+	}
+
+	pos += negative ? -size : size;
+	ustep_pos[axis] = pos;
+
+	if(!(ustep_coarse & (1<<axis))
+		|| pos - ustep_phys[axis] >= USTEP_COARSE_RATIO
+		|| ustep_phys[axis] - pos >= USTEP_COARSE_RATIO)
+	{
+		motor_step(axis);
+		ustep_phys[axis] = pos;
+	}
+}
+
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.  
 // It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately. 
 // Time for ISR is at the moment 14 us --> :-( need to be faster
@@ -218,6 +348,7 @@ void trapezoid_generator_reset()
 void TC0_IrqHandler(void)
 {        
 	volatile unsigned int dummy;
+	unsigned char loop;
 	
 	PIO_Set(&time_check1);
     
@@ -246,10 +377,29 @@ void TC0_IrqHandler(void)
 			#ifdef ADVANCE
 			e_steps[current_block->active_extruder] = 0;
 			#endif
+
+			block_axes = 0;
+			if(current_block->steps_x) block_axes |= 1<<X_AXIS;
+			if(current_block->steps_y) block_axes |= 1<<Y_AXIS;
+			if(current_block->steps_z) block_axes |= 1<<Z_AXIS;
+			if(current_block->steps_e) block_axes |= 1<<(current_block->active_extruder == 1 ? E1_AXIS : E_AXIS);
+			block_current = (current_block->accelerate_until > 0) ? MOTOR_CURRENT_BOOST : MOTOR_CURRENT_RUN;
+			motor_current_block(block_axes, block_current);
+			ustep_block_start();
 		} 
 		else
 		{
 			AT91C_BASE_TC0->TC_RC=500; // ~1kHz.
+
+			// stopped: put the drivers back on the exact position
+			if(ustep_coarse)
+			{
+				for(loop = 0; loop < USTEP_AXES; loop++)
+				{
+					if(ustep_coarse & (1<<loop))
+						ustep_to_fine(loop);
+				}
+			}
 		}    
 	} 
 
@@ -441,78 +591,87 @@ void TC0_IrqHandler(void)
 		//PIO_Clear(&time_check1);
 		
 		  
-		#ifdef ADVANCE
-		counter_e += current_block->steps_e;
-		if (counter_e > 0) {
-			counter_e -= current_block->step_event_count;
-			if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
-				e_steps[current_block->active_extruder]--;
-			}
-			else {
-				e_steps[current_block->active_extruder]++;
-			}
-		}    
-		#endif //ADVANCE
+		// Several step events per interrupt while every moving axis runs in 1/4 steps,
+		// each axis then pulses at most once.
+		step_loops = (block_axes & ~ustep_coarse) ? 1 : USTEP_COARSE_RATIO;
+		for(loop = 0; loop < step_loops; loop++)
+		{
+			if(loop > 0 && step_events_completed >= current_block->step_event_count)
+				break;
 
-		counter_x += current_block->steps_x;
-		if (counter_x > 0) {
-			if(!endstop_x_hit)
-			{
-				if(virtual_steps_x)
-					virtual_steps_x--;
+			#ifdef ADVANCE
+			counter_e += current_block->steps_e;
+			if (counter_e > 0) {
+				counter_e -= current_block->step_event_count;
+				if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
+					e_steps[current_block->active_extruder]--;
+				}
+				else {
+					e_steps[current_block->active_extruder]++;
+				}
+			}    
+			#endif //ADVANCE
+
+			counter_x += current_block->steps_x;
+			if (counter_x > 0) {
+				if(!endstop_x_hit)
+				{
+					if(virtual_steps_x)
+						virtual_steps_x--;
+					else
+						ustep_step(X_AXIS, out_bits & (1<<X_AXIS));
+				}
 				else
-					motor_step(X_AXIS);
-			}
-			else
-				virtual_steps_x++;
+					virtual_steps_x++;
 
-			counter_x -= current_block->step_event_count;
-		}
+				counter_x -= current_block->step_event_count;
+			}
 
-		counter_y += current_block->steps_y;
-		if (counter_y > 0) {
-			if(!endstop_y_hit)
-			{
-				if(virtual_steps_y)
-					virtual_steps_y--;
+			counter_y += current_block->steps_y;
+			if (counter_y > 0) {
+				if(!endstop_y_hit)
+				{
+					if(virtual_steps_y)
+						virtual_steps_y--;
+					else
+						ustep_step(Y_AXIS, out_bits & (1<<Y_AXIS));
+				}
 				else
-					motor_step(Y_AXIS);
+					virtual_steps_y++;
+
+				counter_y -= current_block->step_event_count;
 			}
-			else
-				virtual_steps_y++;
 
-			counter_y -= current_block->step_event_count;
-		}
+			counter_z += current_block->steps_z;
+			if (counter_z > 0) {
+				if(!endstop_z_hit)
+				{
+					if(virtual_steps_z)
+						virtual_steps_z--;
+					else
+						ustep_step(Z_AXIS, out_bits & (1<<Z_AXIS));
+				}
+				else
+					virtual_steps_z++;
 
-		counter_z += current_block->steps_z;
-		if (counter_z > 0) {
-			if(!endstop_z_hit)
+				counter_z -= current_block->step_event_count;
+			}
+
+			#ifndef ADVANCE
+			counter_e += current_block->steps_e;
+			if (counter_e > 0) 
 			{
-				if(virtual_steps_z)
-					virtual_steps_z--;
+				if(current_block->active_extruder == 1)
+					motor_step(E1_AXIS);
 				else
-					motor_step(Z_AXIS);
+					motor_step(E_AXIS);
+				
+				counter_e -= current_block->step_event_count;
 			}
-			else
-				virtual_steps_z++;
+			#endif //!ADVANCE
 
-			counter_z -= current_block->step_event_count;
+			step_events_completed += 1;  
 		}
-
-		#ifndef ADVANCE
-		counter_e += current_block->steps_e;
-		if (counter_e > 0) 
-		{
-			if(current_block->active_extruder == 1)
-				motor_step(E1_AXIS);
-			else
-				motor_step(E_AXIS);
-				
-			counter_e -= current_block->step_event_count;
-		}
-		#endif //!ADVANCE
-
-		step_events_completed += 1;  
 		  
 
 		// Calculare new timer value
@@ -528,7 +687,7 @@ void TC0_IrqHandler(void)
 				acc_step_rate = current_block->nominal_rate;
 
 			// step_rate to timer interval
-			timer = calc_timer(acc_step_rate);
+			timer = calc_timer(acc_step_rate / step_loops);
 			AT91C_BASE_TC0->TC_RC = timer;
 			acceleration_time += timer;
 			#ifdef ADVANCE
@@ -554,7 +713,7 @@ void TC0_IrqHandler(void)
 				step_rate = current_block->final_rate;
 
 			// step_rate to timer interval
-			timer = calc_timer(step_rate);
+			timer = calc_timer(step_rate / step_loops);
 			AT91C_BASE_TC0->TC_RC = timer;
 			deceleration_time += timer;
 			#ifdef ADVANCE
@@ -564,14 +723,30 @@ void TC0_IrqHandler(void)
 			old_advance = advance >>8;  
 			#endif //ADVANCE
 		}
+		else if (step_loops > 1)
+		{
+			AT91C_BASE_TC0->TC_RC = calc_timer(current_block->nominal_rate / step_loops);
+		}
 		else 
 		{
 			AT91C_BASE_TC0->TC_RC = TC_RC_nominal;
 		}
 
+		// Boost the current while the speed changes
+		{
+			unsigned char level = (step_events_completed < (unsigned long)current_block->accelerate_until
+				|| step_events_completed >= (unsigned long)current_block->decelerate_after) ? MOTOR_CURRENT_BOOST : MOTOR_CURRENT_RUN;
+			if(level != block_current)
+			{
+				block_current = level;
+				motor_current_block(block_axes, level);
+			}
+		}
+
 		// If current block is finished, reset pointer 
 		if (step_events_completed >= current_block->step_event_count) 
 		{
+			motor_current_block_end();
 			current_block = NULL;
 			plan_discard_current_block();
 		}   
@@ -33,6 +33,7 @@ extern const Pin Z_MAX_PIN;
 void ConfigureTc0_Stepper(void);
 void stepper_setup(void);
 void enable_endstops(unsigned char check);
+void stepper_ustep_sync(void);
  
   
 #endif /* end of include guard: STEPPER_CONTROL_H_3FACLIDQ */
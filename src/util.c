@@ -12,4 +12,34 @@ void delay_ms(unsigned long msec)
 	//TODO: handle overflow
 	while(timestamp < curms) { __asm volatile("nop"); }
 	
-}
\ No newline at end of file
+}
+
+#define CRC16POLY 0x8408
+/*
+//                                      16   12   5
+// this is the CCITT CRC 16 polynomial X  + X  + X  + 1.
+// This works out to be 0x1021, but the way the algorithm works
+// lets us use 0x8408 (the reverse of the bit pattern).  The high
+// bit is always assumed to be set, thus we only use 16 bits to
+// represent the 17 bit value.
+// Start value is 0xffff, the result is inverted.
+*/
+unsigned short crc16(const void* data, unsigned int len)
+{
+	const unsigned char* ptr = data;
+	unsigned short crc = 0xffff;
+	unsigned char cnt_c;
+	unsigned short byte;
+
+	while (len--)
+	{
+		for (cnt_c=0, byte=*ptr++;cnt_c < 8;cnt_c++, byte >>= 1)
+		{
+			if ((crc & 0x0001) ^ (byte & 0x0001))
+				crc = (crc >> 1) ^ CRC16POLY;
+			else
+				crc >>= 1;
+		}
+	}
+	return ~crc;
+}
@@ -3,6 +3,25 @@
 
 
 void delay_ms(unsigned long msec);
+unsigned short crc16(const void* data, unsigned int len);
+
+// keeps the compiler and the core from reordering memory accesses across this point,
+// used where data is handed between an interrupt handler and the main loop
+#define memory_barrier() __asm volatile ("dmb" ::: "memory")
+
+// disable all interrupts and return the previous state, usable from any context
+static inline unsigned int irq_save(void)
+{
+	unsigned int state;
+	__asm volatile ("mrs %0, primask\n\tcpsid i" : "=r" (state) :: "memory");
+	return state;
+}
+
+// restore the interrupt state returned by irq_save()
+static inline void irq_restore(unsigned int state)
+{
+	__asm volatile ("msr primask, %0" :: "r" (state) : "memory");
+}
 
 
 